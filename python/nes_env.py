@@ -0,0 +1,147 @@
+"""ctypes binding for the nes-env shared library (see src/nes_env.h).
+
+    env = VecEnv("game.nes", num_envs=64, frameskip=4)
+    obs = env.reset()
+    obs, rewards, dones = env.step(actions)  # actions: uint8 array of num_envs
+
+The returned arrays are reused by every call, and the library writes into them
+directly, so copy them if they need to outlive the next step.
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+OBS_PIXELS = 0
+OBS_RAM = 1
+OBS_GREYSCALE = 2
+
+
+class Config(ctypes.Structure):
+    _fields_ = [
+        ("num_envs", ctypes.c_int),
+        ("num_threads", ctypes.c_int),
+        ("observation", ctypes.c_int),
+        ("frameskip", ctypes.c_int),
+        ("max_pool", ctypes.c_int),
+        ("noop_max", ctypes.c_int),
+        ("max_episode_steps", ctypes.c_int),
+        ("reward_address", ctypes.c_int),
+        ("reward_bytes", ctypes.c_int),
+        ("done_address", ctypes.c_int),
+        ("done_value", ctypes.c_int),
+        ("obs_width", ctypes.c_int),
+        ("obs_height", ctypes.c_int),
+        ("crop_top", ctypes.c_int),
+        ("crop_bottom", ctypes.c_int),
+        ("crop_left", ctypes.c_int),
+        ("crop_right", ctypes.c_int),
+        ("frame_stack", ctypes.c_int),
+        ("cache_mb", ctypes.c_int),
+    ]
+
+
+class CacheStats(ctypes.Structure):
+    _fields_ = [
+        ("hits", ctypes.c_uint64),
+        ("misses", ctypes.c_uint64),
+        ("evictions", ctypes.c_uint64),
+        ("entries", ctypes.c_uint64),
+        ("bytes", ctypes.c_uint64),
+    ]
+
+
+def _load_library(path):
+    if path is None:
+        path = os.environ.get("NES_ENV_LIBRARY")
+    if path is None:
+        name = {"nt": "nes-env.dll"}.get(os.name, "libnes-env.so")
+        path = os.path.join(os.path.dirname(__file__), "..", "build", name)
+    lib = ctypes.CDLL(path)
+    u8 = ctypes.POINTER(ctypes.c_uint8)
+    lib.nes_env_default_config.argtypes = [ctypes.POINTER(Config)]
+    lib.nes_env_create.argtypes = [ctypes.c_char_p, ctypes.POINTER(Config)]
+    lib.nes_env_create.restype = ctypes.c_void_p
+    lib.nes_env_destroy.argtypes = [ctypes.c_void_p]
+    lib.nes_env_observation_size.argtypes = [ctypes.c_void_p]
+    lib.nes_env_observation_size.restype = ctypes.c_size_t
+    lib.nes_env_reset.argtypes = [ctypes.c_void_p,
+                                  ctypes.POINTER(ctypes.c_uint64), u8]
+    lib.nes_env_step.argtypes = [ctypes.c_void_p, u8, u8,
+                                 ctypes.POINTER(ctypes.c_float), u8]
+    lib.nes_env_cache_stats.argtypes = [ctypes.c_void_p,
+                                        ctypes.POINTER(CacheStats)]
+    return lib
+
+
+def _ptr(array, ctype):
+    return array.ctypes.data_as(ctypes.POINTER(ctype))
+
+
+class VecEnv:
+    """num_envs emulators stepped together. Any config field from
+    src/nes_env.h can be passed as a keyword argument, with observation
+    taking "pixels", "ram" or "greyscale"."""
+
+    def __init__(self, rom, num_envs, observation="pixels", library=None,
+                 **config):
+        self._lib = _load_library(library)
+        c = Config()
+        self._lib.nes_env_default_config(ctypes.byref(c))
+        c.num_envs = num_envs
+        c.observation = {"pixels": OBS_PIXELS, "ram": OBS_RAM,
+                         "greyscale": OBS_GREYSCALE}[observation]
+        for key, value in config.items():
+            setattr(c, key, int(value))
+        self._env = self._lib.nes_env_create(rom.encode(), ctypes.byref(c))
+        if not self._env:
+            raise RuntimeError("Could not load " + rom)
+
+        self.num_envs = num_envs
+        if c.observation == OBS_PIXELS:
+            shape = (240, 256, 3)
+        elif c.observation == OBS_RAM:
+            shape = (0x800,)
+        else:
+            # The library clamps the size to the crop, which is never scaled up
+            width = min(c.obs_width, 256 - c.crop_left - c.crop_right)
+            height = min(c.obs_height, 240 - c.crop_top - c.crop_bottom)
+            shape = (max(c.frame_stack, 1), height, width)
+        assert np.prod(shape) == self._lib.nes_env_observation_size(self._env)
+        self.observations = np.zeros((num_envs,) + shape, dtype=np.uint8)
+        self.rewards = np.zeros(num_envs, dtype=np.float32)
+        self.dones = np.zeros(num_envs, dtype=np.uint8)
+
+    def reset(self, seeds=None):
+        seeds_ptr = None
+        if seeds is not None:
+            seeds = np.ascontiguousarray(seeds, dtype=np.uint64)
+            assert seeds.shape == (self.num_envs,)
+            seeds_ptr = _ptr(seeds, ctypes.c_uint64)
+        self._lib.nes_env_reset(self._env, seeds_ptr,
+                                _ptr(self.observations, ctypes.c_uint8))
+        return self.observations
+
+    def step(self, actions):
+        actions = np.ascontiguousarray(actions, dtype=np.uint8)
+        assert actions.shape == (self.num_envs,)
+        self._lib.nes_env_step(self._env, _ptr(actions, ctypes.c_uint8),
+                               _ptr(self.observations, ctypes.c_uint8),
+                               _ptr(self.rewards, ctypes.c_float),
+                               _ptr(self.dones, ctypes.c_uint8))
+        return self.observations, self.rewards, self.dones.astype(bool)
+
+    def cache_stats(self):
+        """Counters of the transition cache (the cache_mb option)."""
+        stats = CacheStats()
+        self._lib.nes_env_cache_stats(self._env, ctypes.byref(stats))
+        return {name: getattr(stats, name) for name, _ in CacheStats._fields_}
+
+    def close(self):
+        if self._env:
+            self._lib.nes_env_destroy(self._env)
+            self._env = None
+
+    def __del__(self):
+        self.close()
@@ -0,0 +1,108 @@
+"""Client for the shared memory server (nes-headless game.nes --serve PATH,
+see src/shm_protocol.h).
+
+    client = Client("/tmp/nes.sock")
+    client.buttons[0] = 0x80  # Right
+    client.step(4)
+    ram, pixels = client.ram, client.pixels  # memoryviews into the region
+
+The views always show the state after the last request, so copy them if they
+need to outlive the next one.
+"""
+
+import socket
+import struct
+from multiprocessing import resource_tracker, shared_memory
+
+MAGIC = 0x314D4853
+
+STEP = 1
+RESET = 2
+SAVE = 3
+LOAD = 4
+QUIT = 5
+
+MAX_STEP = 3600
+
+_HELLO = struct.Struct("<II56s")
+_REQUEST = struct.Struct("<II")
+_REPLY = struct.Struct("<iI")
+# NesShmHeader up to the fields written by the server
+_HEADER = struct.Struct("<9IB")
+_BUTTONS_OFFSET = _HEADER.size
+
+
+def _read_all(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("server closed the connection")
+        data += chunk
+    return data
+
+
+class Client:
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(path)
+        magic, size, name = _HELLO.unpack(_read_all(self._sock, _HELLO.size))
+        if magic != MAGIC:
+            raise ConnectionError("no shared memory server at " + path)
+        name = name.split(b"\0")[0].decode().lstrip("/")
+        try:
+            self._shm = shared_memory.SharedMemory(name, track=False)
+        except TypeError:
+            # Before Python 3.13, which would unlink it at exit
+            self._shm = shared_memory.SharedMemory(name)
+            resource_tracker.unregister(self._shm._name, "shared_memory")
+
+        self._region = region = self._shm.buf[:size]
+        (_, _, ram, pixels, audio, audio_capacity, self.audio_rate,
+         _, _, _) = _HEADER.unpack_from(region)
+        self.ram = region[ram:ram + 0x800]
+        self.pixels = region[pixels:pixels + 240 * 256 * 3]
+        self._audio = region[audio:audio + audio_capacity * 2].cast("h")
+        self.buttons = region[_BUTTONS_OFFSET:_BUTTONS_OFFSET + 2]
+
+    def _header(self):
+        return _HEADER.unpack_from(self._region)
+
+    @property
+    def frame(self):
+        return self._header()[7]
+
+    @property
+    def lag_frame(self):
+        return bool(self._header()[9])
+
+    @property
+    def audio(self):
+        """Interleaved stereo samples of the last step."""
+        return self._audio[:self._header()[8]]
+
+    def request(self, command, arg=0):
+        self._sock.sendall(_REQUEST.pack(command, arg))
+        status, _ = _REPLY.unpack(_read_all(self._sock, _REPLY.size))
+        return status == 0
+
+    def step(self, frames=1):
+        return self.request(STEP, frames)
+
+    def reset(self):
+        return self.request(RESET)
+
+    def save(self, slot=0):
+        return self.request(SAVE, slot)
+
+    def load(self, slot=0):
+        return self.request(LOAD, slot)
+
+    def close(self):
+        if self._sock:
+            for view in (self.ram, self.pixels, self._audio, self.buttons,
+                         self._region):
+                view.release()
+            self._shm.close()
+            self._sock.close()
+            self._sock = None
@@ -1,10 +1,13 @@
 #include "audio.h"
+#include <algorithm>
 #include <cstdio>
 
 namespace {
-constexpr int nominal_frequency = 44100;
 constexpr float max_frequency_difference = 0.02f;
-constexpr int target_queue_size = nominal_frequency / 60 * 3;
+// Three frames of samples
+int target_queue_size(int frequency) {
+  return frequency / 60 * 3 * Audio::channels;
+}
 }  // namespace
 
 bool Audio::init() {
@@ -12,48 +15,82 @@ bool Audio::init() {
     fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
     return false;
   }
+  return open_device(frequency);
+}
 
+bool Audio::open_device(int frequency) {
   SDL_AudioSpec audio_spec;
   SDL_zero(audio_spec);
-  audio_spec.freq = nominal_frequency;
+  audio_spec.freq = frequency;
   audio_spec.format = AUDIO_S16SYS;
-  audio_spec.channels = 1;
+  audio_spec.channels = channels;
   audio_spec.samples = 1024;
-  audio_spec.callback = NULL;
-  if ((audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_spec, NULL, 0)) < 0) {
+  audio_spec.callback = &Audio::callback;
+  audio_spec.userdata = this;
+  SDL_AudioSpec obtained;
+  audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_spec, &obtained,
+                                     SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (audio_device == 0) {
     fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
     return false;
   }
+  this->frequency = std::min(obtained.freq, Resampler::max_output_rate);
+  average_queue_size = 0;
+  nes.apu.set_output_rate(this->frequency);
   SDL_PauseAudioDevice(audio_device, 0);
 
   return true;
 }
 
+bool Audio::set_frequency(int frequency) {
+  if (audio_device != 0) {
+    // Also waits for the callback to finish
+    SDL_CloseAudioDevice(audio_device);
+  }
+  samples.clear();
+  return open_device(frequency);
+}
+
 void Audio::destroy() {
   SDL_CloseAudioDevice(audio_device);
   SDL_Quit();
 }
 
+void Audio::callback(void* userdata, uint8_t* stream, int len) {
+  Audio& audio = *static_cast<Audio*>(userdata);
+  int16_t* out = reinterpret_cast<int16_t*>(stream);
+  int count = len / sizeof(int16_t);
+  // Always pop whole frames so the channels stay in order
+  int popped = audio.samples.pop(out, count) / channels * channels;
+  if (popped > 0) {
+    for (int c = 0; c < channels; c++) {
+      audio.last_sample[c] = out[popped - channels + c];
+    }
+  }
+  // On underrun, hold the last sample rather than clicking to silence
+  for (int i = popped; i < count; i++) {
+    out[i] = audio.last_sample[i % channels];
+  }
+}
+
 void Audio::output() {
+  PERF_TIMER(nes.perf, audio_output_ms);
   // Exponential moving average of audio queue size
-  int queue_size = SDL_GetQueuedAudioSize(audio_device) / sizeof(int16_t);
+  int queue_size = samples.size();
   constexpr float alpha = 0.1f;
   average_queue_size =
       (int)(queue_size * alpha + average_queue_size * (1.0f - alpha));
 
   // Adjust sample frequency to try and maintain a constant queue size
-  float diff =
-      (float)(average_queue_size - target_queue_size) / target_queue_size;
+  int target = target_queue_size(frequency);
+  float diff = (float)(average_queue_size - target) / target;
   diff = std::min(std::max(diff, -1.0f), 1.0f);
-  int sample_rate =
-      (int)(nominal_frequency * (1.0f - diff * max_frequency_difference));
+  int sample_rate = (int)(frequency * (1.0f - diff * max_frequency_difference));
   nes.apu.set_sample_rate(sample_rate);
 
-  if (queue_size > target_queue_size * 2) {
+  if (queue_size > target * 2) {
     // Queue is too large, just skip this frame's audio to catch up faster
   } else {
-    SDL_QueueAudio(audio_device, nes.apu.output_buffer,
-                   nes.apu.sample_count * sizeof(int16_t));
+    samples.push(nes.apu.output_buffer.data(), nes.apu.output_buffer.size());
   }
-  nes.apu.clear_output_buffer();
-}
\ No newline at end of file
+}
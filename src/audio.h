@@ -1,17 +1,34 @@
 #pragma once
 #include <SDL.h>
 #include "nes/nes.h"
+#include "nes/ring_buffer.h"
 
 class Audio {
  public:
-  Audio(NES& nes) : nes(nes) {}
+  static constexpr int channels = 2;
+
+  Audio(NES& nes) : nes(nes), samples(32768) {}
   bool init();
   void destroy();
+  // Reopens the device at a new rate. Call with the emulation paused or
+  // locked, since output() reads the frequency.
+  bool set_frequency(int frequency);
+  int get_frequency() { return frequency; }
+  // Moves the samples of the last emulated frame into the playback queue
   void output();
 
  private:
   NES& nes;
 
-  SDL_AudioDeviceID audio_device;
+  SDL_AudioDeviceID audio_device = 0;
+  int frequency = 44100;
   int average_queue_size = 0;
-};
\ No newline at end of file
+
+  // Interleaved stereo. Filled by output() on the emulation thread, drained
+  // by the SDL callback.
+  RingBuffer<int16_t> samples;
+  int16_t last_sample[channels] = {0};
+
+  bool open_device(int frequency);
+  static void callback(void* userdata, uint8_t* stream, int len);
+};
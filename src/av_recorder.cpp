@@ -0,0 +1,313 @@
+#include "av_recorder.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AV_RECORDER_SSE2
+#endif
+
+namespace {
+
+constexpr int width = 256;
+constexpr int height = 240;
+constexpr int y_size = width * height;
+constexpr int chroma_size = y_size / 4;
+constexpr int channels = 2;
+
+#ifndef AV_RECORDER_SSE2
+// 8 bit BT.601 limited range, as 8.8 fixed point
+int luma(int r, int g, int b) {
+  return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+int chroma_u(int r, int g, int b) {
+  return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+int chroma_v(int r, int g, int b) {
+  return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+#endif
+
+#ifdef AV_RECORDER_SSE2
+// Sums of horizontal pairs of 16 values, in 8 lanes
+__m128i pair_sums(__m128i a, __m128i b) {
+  const __m128i ones = _mm_set1_epi16(1);
+  return _mm_packs_epi32(_mm_madd_epi16(a, ones), _mm_madd_epi16(b, ones));
+}
+
+// (c0 * r + c1 * g + c2 * b + 128) >> 8, plus offset. The weighted sum has to
+// fit in 16 bits, signed if is_signed.
+__m128i weighted(__m128i r,
+                 __m128i g,
+                 __m128i b,
+                 int c0,
+                 int c1,
+                 int c2,
+                 int offset,
+                 bool is_signed) {
+  __m128i sum = _mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(c0)),
+                    _mm_mullo_epi16(g, _mm_set1_epi16(c1))),
+      _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(c2)),
+                    _mm_set1_epi16(128)));
+  sum = is_signed ? _mm_srai_epi16(sum, 8) : _mm_srli_epi16(sum, 8);
+  return _mm_add_epi16(sum, _mm_set1_epi16(offset));
+}
+#endif
+
+void put_u16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+void put_u32(uint8_t* p, uint32_t value) {
+  put_u16(p, value & 0xFFFF);
+  put_u16(p + 2, value >> 16);
+}
+
+}  // namespace
+
+void rgb_to_yuv420(const uint8_t (&in)[240][256][3], uint8_t* out) {
+  uint8_t* y_plane = out;
+  uint8_t* u_plane = out + y_size;
+  uint8_t* v_plane = u_plane + chroma_size;
+
+  // Two rows at a time, split into 16 bit planes first so the math can run
+  // 8 pixels wide
+  int16_t planes[2][3][width];
+  for (int y = 0; y < height; y += 2) {
+    for (int row = 0; row < 2; row++) {
+      for (int x = 0; x < width; x++) {
+        for (int c = 0; c < 3; c++) {
+          planes[row][c][x] = in[y + row][x][c];
+        }
+      }
+    }
+
+    for (int row = 0; row < 2; row++) {
+      int16_t(*p)[width] = planes[row];
+      uint8_t* out_row = y_plane + (y + row) * width;
+#ifdef AV_RECORDER_SSE2
+      for (int x = 0; x < width; x += 8) {
+        __m128i r = _mm_loadu_si128((const __m128i*)&p[0][x]);
+        __m128i g = _mm_loadu_si128((const __m128i*)&p[1][x]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&p[2][x]);
+        __m128i y_out = weighted(r, g, b, 66, 129, 25, 16, false);
+        _mm_storel_epi64((__m128i*)&out_row[x],
+                         _mm_packus_epi16(y_out, y_out));
+      }
+#else
+      for (int x = 0; x < width; x++) {
+        out_row[x] = luma(p[0][x], p[1][x], p[2][x]);
+      }
+#endif
+    }
+
+    uint8_t* u_row = u_plane + (y / 2) * (width / 2);
+    uint8_t* v_row = v_plane + (y / 2) * (width / 2);
+#ifdef AV_RECORDER_SSE2
+    const __m128i two = _mm_set1_epi16(2);
+    for (int x = 0; x < width; x += 16) {
+      __m128i average[3];
+      for (int c = 0; c < 3; c++) {
+        __m128i a = _mm_add_epi16(
+            _mm_loadu_si128((const __m128i*)&planes[0][c][x]),
+            _mm_loadu_si128((const __m128i*)&planes[1][c][x]));
+        __m128i b = _mm_add_epi16(
+            _mm_loadu_si128((const __m128i*)&planes[0][c][x + 8]),
+            _mm_loadu_si128((const __m128i*)&planes[1][c][x + 8]));
+        average[c] = _mm_srli_epi16(_mm_add_epi16(pair_sums(a, b), two), 2);
+      }
+      __m128i u = weighted(average[0], average[1], average[2], -38, -74, 112,
+                           128, true);
+      __m128i v = weighted(average[0], average[1], average[2], 112, -94, -18,
+                           128, true);
+      _mm_storel_epi64((__m128i*)&u_row[x / 2], _mm_packus_epi16(u, u));
+      _mm_storel_epi64((__m128i*)&v_row[x / 2], _mm_packus_epi16(v, v));
+    }
+#else
+    for (int x = 0; x < width; x += 2) {
+      int average[3];
+      for (int c = 0; c < 3; c++) {
+        average[c] = (planes[0][c][x] + planes[0][c][x + 1] +
+                      planes[1][c][x] + planes[1][c][x + 1] + 2) >>
+                     2;
+      }
+      u_row[x / 2] = chroma_u(average[0], average[1], average[2]);
+      v_row[x / 2] = chroma_v(average[0], average[1], average[2]);
+    }
+#endif
+  }
+}
+
+AVRecorder::~AVRecorder() {
+  close();
+}
+
+bool AVRecorder::open(const char* video_filename,
+                      const char* audio_filename,
+                      int sample_rate,
+                      float min_speed) {
+  if (video_filename) {
+    video_file = fopen(video_filename, "wb");
+    if (!video_file) {
+      fprintf(stderr, "Could not open %s for writing\n", video_filename);
+      return false;
+    }
+    // NTSC NES frame rate and 8:7 pixel aspect. C420jpeg is chroma sited in
+    // the middle of each 2x2 block, which is what averaging gives.
+    fprintf(video_file,
+            "YUV4MPEG2 W%d H%d F39375000:655171 Ip A8:7 C420jpeg\n", width,
+            height);
+  }
+  if (audio_filename) {
+    audio_file = fopen(audio_filename, "wb");
+    if (!audio_file) {
+      fprintf(stderr, "Could not open %s for writing\n", audio_filename);
+      if (video_file) {
+        fclose(video_file);
+        video_file = nullptr;
+      }
+      return false;
+    }
+  }
+
+  this->sample_rate = sample_rate;
+  this->min_speed = min_speed;
+  audio_bytes = 0;
+  if (audio_file) {
+    // Sizes are filled in by close()
+    write_wav_header();
+  }
+  closing = false;
+  frame_index = 0;
+  stats_ = Stats();
+  start_time = std::chrono::steady_clock::now();
+  thread = std::thread(&AVRecorder::loop, this);
+  return true;
+}
+
+void AVRecorder::add_frame(const uint8_t (&pixels)[240][256][3],
+                           const int16_t* samples,
+                           size_t count) {
+  auto start = std::chrono::steady_clock::now();
+  Packet packet;
+  std::unique_lock<std::mutex> lock(mutex);
+  auto has_space = [this] { return (int)queue.size() < max_queued_frames; };
+  bool dropped = false;
+  if (min_speed > 0.0f) {
+    // Only wait until the frame would be due at min_speed
+    constexpr double frame_seconds = 655171.0 / 39375000.0;
+    auto deadline =
+        start_time + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::duration<double>(
+                             frame_index * frame_seconds / min_speed));
+    dropped = !condition.wait_until(lock, deadline, has_space);
+  } else {
+    condition.wait(lock, has_space);
+  }
+  frame_index++;
+  std::chrono::duration<double, std::milli> blocked =
+      std::chrono::steady_clock::now() - start;
+  stats_.blocked_ms += blocked.count();
+  if (dropped) {
+    stats_.frames_dropped++;
+    return;
+  }
+  if (!free_packets.empty()) {
+    packet = std::move(free_packets.back());
+    free_packets.pop_back();
+  }
+
+  // Copy without holding up the writer
+  lock.unlock();
+  packet.pixels.assign(&pixels[0][0][0], &pixels[0][0][0] + sizeof(pixels));
+  packet.samples.assign(samples, samples + count);
+  lock.lock();
+  queue.push_back(std::move(packet));
+  condition.notify_all();
+}
+
+void AVRecorder::close() {
+  if (!thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+  }
+  condition.notify_all();
+  thread.join();
+
+  if (video_file) {
+    fclose(video_file);
+    video_file = nullptr;
+  }
+  if (audio_file) {
+    fseek(audio_file, 0, SEEK_SET);
+    write_wav_header();
+    fclose(audio_file);
+    audio_file = nullptr;
+  }
+}
+
+void AVRecorder::loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    condition.wait(lock, [this] { return !queue.empty() || closing; });
+    if (queue.empty()) {
+      return;
+    }
+    Packet packet = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    write(packet);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    lock.lock();
+    stats_.write_ms += elapsed.count();
+    stats_.frames_written++;
+    free_packets.push_back(std::move(packet));
+    condition.notify_all();
+  }
+}
+
+void AVRecorder::write(const Packet& packet) {
+  if (video_file) {
+    buffer.resize(y_size + chroma_size * 2);
+    rgb_to_yuv420(
+        *reinterpret_cast<const uint8_t(*)[240][256][3]>(packet.pixels.data()),
+        buffer.data());
+    fputs("FRAME\n", video_file);
+    fwrite(buffer.data(), buffer.size(), 1, video_file);
+  }
+  if (audio_file && !packet.samples.empty()) {
+    // WAV is little endian
+    buffer.resize(packet.samples.size() * 2);
+    for (size_t i = 0; i < packet.samples.size(); i++) {
+      put_u16(&buffer[i * 2], (uint16_t)packet.samples[i]);
+    }
+    fwrite(buffer.data(), buffer.size(), 1, audio_file);
+    audio_bytes += buffer.size();
+  }
+}
+
+void AVRecorder::write_wav_header() {
+  uint8_t header[44];
+  memcpy(header, "RIFF", 4);
+  put_u32(header + 4, 36 + audio_bytes);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_u32(header + 16, 16);
+  put_u16(header + 20, 1);  // PCM
+  put_u16(header + 22, channels);
+  put_u32(header + 24, sample_rate);
+  put_u32(header + 28, sample_rate * channels * 2);
+  put_u16(header + 32, channels * 2);
+  put_u16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  put_u32(header + 40, audio_bytes);
+  fwrite(header, sizeof(header), 1, audio_file);
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Converts a 256x240 RGB frame to 8 bit planar YUV 4:2:0 (BT.601, limited
+// range), with the chroma of each 2x2 block averaged. out needs 256 * 240 * 3
+// / 2 bytes: the Y plane, then U, then V.
+void rgb_to_yuv420(const uint8_t (&in)[240][256][3], uint8_t* out);
+
+// Streams frames to a YUV4MPEG2 video and/or a 16 bit stereo WAV file from a
+// writer thread. Frames wait in a bounded queue; when it's full, add_frame()
+// blocks until the writer catches up, unless that would put emulation behind
+// min_speed times real time, in which case the frame is dropped instead.
+class AVRecorder {
+ public:
+  struct Stats {
+    int frames_written = 0;
+    int frames_dropped = 0;
+    double blocked_ms = 0;  // time add_frame() spent waiting for the writer
+    double write_ms = 0;    // time the writer spent converting and writing
+  };
+
+  AVRecorder(int max_queued_frames = 8)
+      : max_queued_frames(max_queued_frames) {}
+  ~AVRecorder();
+  // Either filename may be null. A min_speed of 0 never drops frames.
+  bool open(const char* video_filename,
+            const char* audio_filename,
+            int sample_rate,
+            float min_speed = 0.0f);
+  void add_frame(const uint8_t (&pixels)[240][256][3],
+                 const int16_t* samples,
+                 size_t count);
+  // Writes out the queue and finishes the files
+  void close();
+  // Only consistent once closed
+  const Stats& stats() { return stats_; }
+
+ private:
+  struct Packet {
+    std::vector<uint8_t> pixels;
+    std::vector<int16_t> samples;
+  };
+
+  int max_queued_frames;
+  float min_speed = 0.0f;
+  int sample_rate = 0;
+  FILE* video_file = nullptr;
+  FILE* audio_file = nullptr;
+  uint32_t audio_bytes = 0;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<Packet> queue;
+  std::vector<Packet> free_packets;  // reused to avoid allocating per frame
+  bool closing = false;
+
+  int frame_index = 0;
+  std::chrono::steady_clock::time_point start_time;
+  Stats stats_;
+
+  void loop();
+  std::vector<uint8_t> buffer;  // writer thread only
+  void write(const Packet& packet);
+  void write_wav_header();
+};
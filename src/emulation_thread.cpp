@@ -0,0 +1,69 @@
+#include "emulation_thread.h"
+#include <chrono>
+#include <cstring>
+
+void HostInput::set_buttons(uint8_t buttons) {
+  if (buttons != current.load(std::memory_order_relaxed)) {
+    changed_at.store(
+        std::chrono::steady_clock::now().time_since_epoch().count(),
+        std::memory_order_relaxed);
+    current.store(buttons, std::memory_order_release);
+  }
+}
+
+uint8_t HostInput::buttons(int joypad) {
+  if (joypad != 0) {
+    return 0;
+  }
+  uint8_t buttons = current.load(std::memory_order_acquire);
+  if (buttons != latched) {
+    latched = buttons;
+    latched_serial++;
+    latched_time = std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(
+            changed_at.load(std::memory_order_relaxed)));
+  }
+  return buttons;
+}
+
+void EmulationThread::start() {
+  running = true;
+  thread = std::thread(&EmulationThread::loop, this);
+}
+
+void EmulationThread::stop() {
+  running = false;
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void EmulationThread::run_frame() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    run_ahead.run_frame();
+    audio.output();
+    Frame& frame = frames.back();
+    memcpy(frame.pixels, nes.ppu.pixels, sizeof(Frame::pixels));
+    frame.input_serial = input.latched_serial;
+    frame.input_time = input.latched_time;
+  }
+  frames.publish();
+}
+
+void EmulationThread::loop() {
+  using clock = std::chrono::steady_clock;
+  constexpr auto frame_time = std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(1.0 / 60.0));
+  auto next_frame = clock::now();
+  while (running) {
+    run_frame();
+    next_frame += frame_time;
+    auto now = clock::now();
+    if (now > next_frame + frame_time * 3) {
+      // Too far behind (e.g. a slow load), so don't try to catch up
+      next_frame = now;
+    }
+    std::this_thread::sleep_until(next_frame);
+  }
+}
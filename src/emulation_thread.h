@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "audio.h"
+#include "nes/nes.h"
+#include "nes/run_ahead.h"
+#include "triple_buffer.h"
+
+struct Frame {
+  uint8_t pixels[240][256][3];
+  // The latest host input change the game had latched by the end of this
+  // frame, for measuring input latency
+  uint32_t input_serial = 0;
+  std::chrono::steady_clock::time_point input_time;
+};
+
+// Host input for joypad 1, handed to the game at the moment it latches the
+// joypads. The UI thread sets it and the emulation thread reads it, without
+// locking.
+class HostInput : public InputProvider {
+ public:
+  // UI thread
+  void set_buttons(uint8_t buttons);
+  // Emulation thread
+  uint8_t buttons(int joypad) override;
+  uint32_t latched_serial = 0;  // counts changes the game has latched
+  std::chrono::steady_clock::time_point latched_time;  // of the last one
+
+ private:
+  std::atomic<uint8_t> current{0};
+  std::atomic<int64_t> changed_at{0};  // steady_clock ticks
+  uint8_t latched = 0;
+};
+
+// Runs the emulator at 60 fps on its own thread, so that rendering stalls
+// don't hold up emulation or audio. Completed frames are handed to the render
+// thread through a triple buffer, and audio through the ring in Audio.
+class EmulationThread {
+ public:
+  // Held while a frame is emulated; lock it before touching the NES from
+  // another thread
+  std::mutex mutex;
+  RunAhead run_ahead;
+  HostInput input;
+
+  EmulationThread(NES& nes, Audio& audio)
+      : run_ahead(nes), nes(nes), audio(audio) {
+    nes.joypad.input_provider = &input;
+  }
+  void start();
+  void stop();
+  // Emulates a single frame on the calling thread. Used directly when there
+  // is no emulation thread (emscripten).
+  void run_frame();
+  // The most recently completed frame
+  const Frame& frame() { return frames.read(); }
+  Audio& get_audio() { return audio; }
+
+ private:
+  NES& nes;
+  Audio& audio;
+
+  TripleBuffer<Frame> frames;
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  void loop();
+};
@@ -0,0 +1,903 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "av_recorder.h"
+#include "nes/fork_pool.h"
+#include "nes/nes.h"
+#include "nes/run_ahead.h"
+#include "nes/transition_cache.h"
+#include "observation.h"
+#include "rollback.h"
+#include "shm_server.h"
+#include "transport.h"
+#include "vec_env.h"
+#include "video_filter.h"
+
+namespace {
+
+struct FrameHash {
+  int frame;
+  uint64_t state;
+  uint64_t video;
+};
+
+void print_usage() {
+  printf(
+      "Usage: nes-headless [rom] [options]\n"
+      "  --frames N        Number of frames to run (default 600)\n"
+      "  --hashes FILE     Write per-frame state/video hashes to FILE\n"
+      "  --trace-frame N   Print an instruction trace of frame N\n"
+      "  --trace FILE      Record a binary CPU trace of the run into FILE\n"
+      "                    (needs a build with NES_TRACE enabled)\n"
+      "  --trace-size N    Keep the last 2^N trace records (default 24)\n"
+      "  --decode-trace F  Print a binary trace in the nestest.log format\n"
+      "  --perf-json FILE  Write the performance counters as JSON to FILE\n"
+      "                    (needs a build with NES_PERF_COUNTERS enabled)\n"
+      "  --profile FILE    Write a CPU profile report to FILE\n"
+      "  --heatmap FILE    Write a 64 KB per-address CPU heatmap to FILE\n"
+      "                    (both need a build with NES_PROFILE enabled)\n"
+      "  --run-ahead N     Present frames N frames ahead (or \"auto\"), and\n"
+      "                    report the per-frame cost\n"
+      "  --netplay-test L  Run two rollback netplay sessions over a loopback\n"
+      "                    link with L frames of latency, and check they\n"
+      "                    agree with a local run\n"
+      "  --netplay-loss P  Drop packets with probability P in the test\n"
+      "  --netplay-udp P   Use UDP on localhost ports P and P+1 instead\n"
+      "  --filter NAME     Video filter for --screenshot: none, nearest2x,\n"
+      "                    nearest3x, nearest4x, scale2x or ntsc\n"
+      "  --screenshot FILE Write the last frame as a PPM image to FILE\n"
+      "  --palette FILE    Load a .pal palette, or \"ntsc\" to generate one\n"
+      "  --filter-benchmark  Time each video filter on the last frame\n"
+      "  --audio-analyze   Summarize each APU channel through the audio tap\n"
+      "  --record-video F  Stream the video to F as YUV4MPEG2\n"
+      "  --record-audio F  Stream the audio to F as a 44.1 kHz stereo WAV\n"
+      "  --record-min-speed X  Drop frames rather than wait for the disk if\n"
+      "                    emulation would fall below X times real time\n"
+      "  --no-idle-skip    Run idle loops instead of fast-forwarding them\n"
+      "  --idle-stats      Report how many cycles idle loop skipping saved\n"
+      "  --test-input      Press pseudo-random buttons on joypad 1\n"
+      "  --skip-lag        Same, but hold each input until the game reads it\n"
+      "  --lag-stats       Report lag frames and when the game polls input\n"
+      "  --env-benchmark N  Time N environments through the nes_env API for\n"
+      "                    --frames frames each\n"
+      "  --serve PATH      Serve the rom to shared memory clients through a\n"
+      "                    Unix socket at PATH\n"
+      "  --connect PATH    Check and time a server at PATH as a client, for\n"
+      "                    --frames steps\n"
+      "  --shm-benchmark   Same as --connect, against a server on a thread\n"
+      "  --fork-benchmark  Time forking the state after --frames frames\n"
+      "  --cache-benchmark MB  Time search rollouts from the state after\n"
+      "                    --frames frames with a transition cache of MB\n"
+      "  --compare A B     Find the first frame where two hash files differ,\n"
+      "                    and trace that frame if a rom is given\n");
+}
+
+std::vector<FrameHash> read_hashes(const char* filename) {
+  std::vector<FrameHash> hashes;
+  FILE* file = fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open hash file %s\n", filename);
+    return hashes;
+  }
+  FrameHash hash;
+  unsigned long long state, video;
+  while (fscanf(file, "%d %llx %llx", &hash.frame, &state, &video) == 3) {
+    hash.state = state;
+    hash.video = video;
+    hashes.push_back(hash);
+  }
+  fclose(file);
+  return hashes;
+}
+
+// Returns the first frame that differs between the two hash files, or -1
+int compare_hashes(const char* filename_a, const char* filename_b) {
+  std::vector<FrameHash> a = read_hashes(filename_a);
+  std::vector<FrameHash> b = read_hashes(filename_b);
+  size_t count = std::min(a.size(), b.size());
+  for (size_t i = 0; i < count; i++) {
+    if (a[i].state != b[i].state || a[i].video != b[i].video) {
+      printf("First divergent frame: %d (%s differs)\n", a[i].frame,
+             a[i].state != b[i].state ? "state" : "video");
+      return a[i].frame;
+    }
+  }
+  if (a.size() != b.size()) {
+    printf("Hash files agree for %zu frames but have different lengths\n",
+           count);
+  } else {
+    printf("Hash files agree for all %zu frames\n", count);
+  }
+  return -1;
+}
+
+uint64_t video_hash(NES& nes) {
+  StateHasher hasher;
+  hasher.update(nes.ppu.pixels, sizeof(nes.ppu.pixels));
+  return hasher.digest();
+}
+
+// Deterministic pseudo-random input for testing, held for 8 frames at a time
+uint8_t test_input(int player, int frame) {
+  uint32_t x = (frame / 8) * 2 + player + 1;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x & 0xFF;
+}
+
+int netplay_test(const char* rom,
+                 int num_frames,
+                 int latency,
+                 float loss,
+                 int udp_port) {
+  // Reference run with both inputs known up front
+  auto reference = std::make_unique<NES>();
+  reference->load(rom);
+  if (!reference->loaded) {
+    return -1;
+  }
+  std::vector<uint64_t> reference_hashes;
+  for (int frame = 0; frame < num_frames; frame++) {
+    reference->joypad.set_buttons(0, test_input(0, frame));
+    reference->joypad.set_buttons(1, test_input(1, frame));
+    reference->run_frame();
+    reference_hashes.push_back(reference->state_hash());
+  }
+
+  LoopbackLink link(latency, loss);
+  std::unique_ptr<Transport> transports[2];
+  if (udp_port > 0) {
+    for (int i = 0; i < 2; i++) {
+      auto udp = std::make_unique<UdpTransport>();
+      if (!udp->open(udp_port + i, "127.0.0.1", udp_port + 1 - i)) {
+        return -1;
+      }
+      transports[i] = std::move(udp);
+    }
+  } else {
+    for (int i = 0; i < 2; i++) {
+      transports[i] = std::make_unique<LoopbackTransport>(link, i);
+    }
+  }
+
+  std::unique_ptr<NES> nes[2];
+  std::unique_ptr<RollbackSession> sessions[2];
+  for (int i = 0; i < 2; i++) {
+    nes[i] = std::make_unique<NES>();
+    nes[i]->load(rom);
+    sessions[i] = std::make_unique<RollbackSession>(*nes[i], *transports[i], i);
+    sessions[i]->record_hashes = true;
+  }
+  // Keep going (with no input) until both sides have confirmed every frame
+  for (int tick = 0; tick < num_frames * 4; tick++) {
+    bool done = true;
+    for (int i = 0; i < 2; i++) {
+      RollbackSession& session = *sessions[i];
+      int frame = session.frame();
+      session.advance_frame(frame < num_frames ? test_input(i, frame) : 0);
+      done = done && session.confirmed_frame() >= num_frames - 1;
+    }
+    link.tick();
+    if (done) {
+      break;
+    }
+  }
+
+  int result = 0;
+  for (int i = 0; i < 2; i++) {
+    const RollbackSession& session = *sessions[i];
+    const RollbackSession::Stats& stats = session.stats;
+    printf("Player %d: %d rollbacks (%.1f frames on average), %d stalls, "
+           "max rollback %.2f ms\n",
+           i + 1, stats.rollbacks,
+           stats.rollbacks ? (double)stats.rollback_frames / stats.rollbacks
+                           : 0.0,
+           stats.stalls, stats.max_rollback_ms);
+    for (int frame = 0; frame < num_frames; frame++) {
+      if (frame >= (int)session.confirmed_hashes.size() ||
+          session.confirmed_hashes[frame] != reference_hashes[frame]) {
+        printf("Player %d diverged from the local run at frame %d\n", i + 1,
+               frame);
+        result = 1;
+        break;
+      }
+    }
+  }
+  if (result == 0) {
+    printf("Both sessions match the local run for %d frames\n", num_frames);
+  }
+  return result;
+}
+
+bool parse_video_filter(const char* name, VideoFilterType& type) {
+  for (int i = 0; i < (int)VideoFilterType::Count; i++) {
+    if (std::string(name) == video_filter_name((VideoFilterType)i)) {
+      type = (VideoFilterType)i;
+      return true;
+    }
+  }
+  fprintf(stderr, "Unknown video filter %s\n", name);
+  return false;
+}
+
+bool write_ppm(const char* filename, const FilteredFrame& frame) {
+  FILE* file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s for writing\n", filename);
+    return false;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", frame.width, frame.height);
+  fwrite(frame.pixels.data(), frame.pixels.size(), 1, file);
+  fclose(file);
+  return true;
+}
+
+void benchmark_video_filters(const uint8_t (&pixels)[240][256][3]) {
+  constexpr int iterations = 200;
+  constexpr double target_ms = 2.0;
+  FilteredFrame frame;
+  printf("Video filters (%d iterations, target %.1f ms/frame):\n",
+         iterations, target_ms);
+  for (int i = 1; i < (int)VideoFilterType::Count; i++) {
+    VideoFilterType type = (VideoFilterType)i;
+    auto start = std::chrono::steady_clock::now();
+    for (int j = 0; j < iterations; j++) {
+      apply_video_filter(type, pixels, frame);
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double ms = elapsed.count() / iterations;
+    printf("  %-10s %4dx%-4d %7.3f ms/frame %8.1f Mpixels/s  %s\n",
+           video_filter_name(type), frame.width, frame.height, ms,
+           frame.width * frame.height / (ms * 1000.0),
+           ms <= target_ms ? "ok" : "SLOW");
+  }
+}
+
+// Steps num_envs environments with the test input, once for each
+// observation type
+void benchmark_env(const char* rom, int num_envs, int num_frames) {
+  const char* names[] = {"pixels", "RAM", "greyscale"};
+  for (int observation :
+       {NES_ENV_OBS_PIXELS, NES_ENV_OBS_RAM, NES_ENV_OBS_GREYSCALE}) {
+    NesEnvConfig config;
+    nes_env_default_config(&config);
+    config.num_envs = num_envs;
+    config.observation = observation;
+    config.frame_stack = observation == NES_ENV_OBS_GREYSCALE ? 4 : 1;
+    VecEnv env(config);
+    if (!env.load(rom)) {
+      return;
+    }
+    std::vector<uint8_t> observations(num_envs * env.observation_size());
+    std::vector<uint8_t> actions(num_envs);
+    std::vector<float> rewards(num_envs);
+    std::vector<uint8_t> dones(num_envs);
+    env.reset(nullptr, observations.data());
+
+    int steps = std::max(num_frames / config.frameskip, 1);
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < steps; step++) {
+      for (int i = 0; i < num_envs; i++) {
+        actions[i] = test_input(i % 2, step + i);
+      }
+      env.step(actions.data(), observations.data(), rewards.data(),
+               dones.data());
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double steps_per_second = steps * num_envs / elapsed.count();
+    printf("Env %s: %d envs on %d threads, %.0f steps/s (%.0f frames/s)\n",
+           names[observation], num_envs, env.num_threads(), steps_per_second,
+           steps_per_second * config.frameskip);
+  }
+
+  // The greyscale kernel on its own, max pooled, on a frame from the game
+  NES nes;
+  nes.load(rom);
+  for (int i = 0; i < 120; i++) {
+    nes.run_frame();
+  }
+  ObservationProcessor processor;
+  processor.configure(ObservationFormat());
+  processor.set_palette(nes.palette);
+  std::vector<uint8_t> pool(processor.luma_size());
+  std::vector<uint8_t> out(processor.output_size());
+  const int iterations = 2000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    processor.luma(nes.ppu.indices, pool.data());
+    processor.process(nes.ppu.indices, pool.data(), out.data());
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("Greyscale %dx%d with max pooling: %.1f us/frame\n",
+         processor.format().width, processor.format().height,
+         elapsed.count() / iterations);
+}
+
+// Forks the state over and over, as a tree search would
+void benchmark_fork(NES& nes) {
+  ForkPool pool;
+  const int iterations = 100000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    pool.release(pool.fork(nes));
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const Mapper& mapper = *nes.cartridge.mapper;
+  printf("Fork: %.0f forks/s, %zu bytes of state copied per fork\n",
+         iterations / elapsed.count(), pool.state_size());
+  printf("  %zu bytes per pooled NES, sharing %zu bytes of ROM\n",
+         sizeof(NES), mapper.pgr_rom->size() + mapper.chr_rom->size());
+
+  // A search step: branch, run a frame from the branch, and drop it
+  const int frames = 200;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    NES* fork = pool.fork(nes);
+    fork->ppu.output_enabled = false;
+    fork->joypad.set_buttons(0, test_input(0, i));
+    fork->run_frame();
+    pool.release(fork);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  printf("  fork and run a frame: %.0f/s\n", frames / elapsed.count());
+}
+
+// Rollouts from the current state down a binary tree of inputs, as a search
+// would run them, without and then with a transition cache
+void benchmark_cache(NES& nes, int cache_mb) {
+  const int rollouts = 256;
+  const int depth = 32;
+  ForkPool pool;
+  uint64_t results[2] = {0, 0};
+  double frames_per_second[2];
+  TransitionCache cache((size_t)cache_mb << 20);
+  for (int cached = 0; cached < 2; cached++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rollouts; r++) {
+      NES* fork = pool.fork(nes);
+      fork->ppu.output_enabled = false;
+      fork->apu.output_enabled = false;
+      for (int d = 0; d < depth; d++) {
+        bool right = (r >> (d % 8)) & 1;
+        fork->joypad.set_buttons(0, right ? 1 << (int)Button::Right : 0);
+        if (cached) {
+          cache.run_frame(*fork);
+        } else {
+          fork->run_frame();
+        }
+      }
+      results[cached] = results[cached] * 31 + fork->state_hash();
+      pool.release(fork);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    frames_per_second[cached] = rollouts * depth / elapsed.count();
+  }
+  TransitionCache::Stats stats = cache.stats();
+  printf("Transition cache: %d rollouts of %d frames, %s\n", rollouts, depth,
+         results[0] == results[1] ? "same results" : "RESULTS DIFFER");
+  printf("  %.0f frames/s uncached, %.0f cached\n", frames_per_second[0],
+         frames_per_second[1]);
+  printf("  hit rate %.1f%%, %zu entries, %.1f MB, %llu evictions\n",
+         100.0 * stats.hit_rate(), stats.entries, stats.bytes / 1048576.0,
+         (unsigned long long)stats.evictions);
+}
+
+// Client side of the shared memory server: checks that a saved state replays
+// exactly, then times num_steps round trips without and with a frame
+bool shm_client_benchmark(const char* socket_path, int num_steps) {
+  ShmClient client;
+  if (!client.connect(socket_path)) {
+    return false;
+  }
+  NesShmHeader* header = client.header();
+  std::vector<uint8_t> runs[2];
+  client.request(NES_SHM_RESET);
+  client.request(NES_SHM_SAVE, 0);
+  for (int run = 0; run < 2; run++) {
+    if (client.request(NES_SHM_LOAD, 0) != 0) {
+      fprintf(stderr, "Could not load the saved state\n");
+      return false;
+    }
+    for (int step = 0; step < 120; step++) {
+      header->buttons[0] = test_input(0, step);
+      client.request(NES_SHM_STEP, 1);
+    }
+    runs[run].assign(client.ram(), client.ram() + 0x800);
+    runs[run].insert(runs[run].end(), client.pixels(),
+                     client.pixels() + 240 * 256 * 3);
+  }
+  printf("Save/load replay: %s (frame %u)\n",
+         runs[0] == runs[1] ? "ok" : "MISMATCH", header->frame);
+
+  num_steps = std::max(num_steps, 1);
+  for (int frames = 0; frames <= 1; frames++) {
+    std::vector<double> times(num_steps);
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < num_steps; step++) {
+      auto request_start = std::chrono::steady_clock::now();
+      header->buttons[0] = test_input(0, step);
+      if (client.request(NES_SHM_STEP, frames) != 0) {
+        fprintf(stderr, "Server went away\n");
+        return false;
+      }
+      std::chrono::duration<double, std::micro> elapsed =
+          std::chrono::steady_clock::now() - request_start;
+      times[step] = elapsed.count();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::sort(times.begin(), times.end());
+    printf("%d frame steps: %.0f/s, median %.1f us, p99 %.1f us, max %.1f us\n",
+           frames, num_steps / elapsed.count(), times[num_steps / 2],
+           times[num_steps * 99 / 100], times.back());
+  }
+  return runs[0] == runs[1];
+}
+
+// Summarizes each APU channel from the audio tap, on its own thread like any
+// other tap consumer
+class AudioAnalyzer {
+ public:
+  static constexpr int rate = 44100;
+
+  AudioAnalyzer(AudioTap& tap) : tap(tap), reader(tap.attach(rate)) {
+    thread = std::thread(&AudioAnalyzer::loop, this);
+  }
+
+  // Drains the tap and prints the results
+  void finish() {
+    running = false;
+    thread.join();
+    tap.detach(reader);
+
+    const char* names[5] = {"Pulse 1", "Pulse 2", "Triangle", "Noise", "DMC"};
+    double seconds = (double)samples / rate;
+    printf("Audio channels (%llu samples at %d Hz, %llu dropped):\n",
+           (unsigned long long)samples, rate,
+           (unsigned long long)reader->dropped());
+    for (int i = 0; i < 5; i++) {
+      printf("  %-8s active %5.1f%%  peak %3d  rising edges %8.1f/s\n",
+             names[i], samples ? 100.0 * active[i] / samples : 0.0, peak[i],
+             seconds > 0 ? edges[i] / seconds : 0.0);
+    }
+  }
+
+ private:
+  AudioTap& tap;
+  std::shared_ptr<AudioTapReader> reader;
+  std::thread thread;
+  std::atomic<bool> running{true};
+
+  uint64_t samples = 0;
+  uint64_t active[5] = {0};
+  uint64_t edges[5] = {0};
+  int peak[5] = {0};
+  uint8_t last[5] = {0};
+
+  void loop() {
+    ChannelLevels levels[1024];
+    while (true) {
+      size_t count = reader->read(levels, 1024);
+      if (count == 0) {
+        if (!running) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+      for (size_t i = 0; i < count; i++) {
+        for (int j = 0; j < 5; j++) {
+          uint8_t level = levels[i].level[j];
+          active[j] += level != 0;
+          edges[j] += level > last[j];
+          peak[j] = std::max(peak[j], (int)level);
+          last[j] = level;
+        }
+      }
+      samples += count;
+    }
+  }
+};
+
+// Same as NES::run_frame(), but prints the CPU state before every instruction
+void trace_frame(NES& nes) {
+  nes.ppu.clear_pixels();
+  nes.joypad.begin_frame();
+  while (!nes.ppu.frame_ready) {
+    nes.cpu.print_state();
+    nes.cpu.execute();
+  }
+  nes.ppu.frame_ready = false;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const char* rom = nullptr;
+  const char* hashes_filename = nullptr;
+  const char* compare_filenames[2] = {nullptr, nullptr};
+  int num_frames = 600;
+  int trace_frame_index = -1;
+  const char* trace_filename = nullptr;
+  int trace_size_log2 = 24;
+  const char* perf_filename = nullptr;
+  const char* profile_filename = nullptr;
+  const char* heatmap_filename = nullptr;
+  const char* run_ahead_frames = nullptr;
+  int netplay_latency = -1;
+  float netplay_loss = 0.0f;
+  int netplay_udp_port = 0;
+  VideoFilterType video_filter = VideoFilterType::None;
+  const char* screenshot_filename = nullptr;
+  bool filter_benchmark = false;
+  const char* palette_filename = nullptr;
+  bool audio_analyze = false;
+  const char* record_video_filename = nullptr;
+  const char* record_audio_filename = nullptr;
+  float record_min_speed = 0.0f;
+  bool idle_skip = true;
+  bool idle_stats = false;
+  bool test_inputs = false;
+  bool skip_lag = false;
+  bool lag_stats = false;
+  int env_benchmark_envs = 0;
+  const char* serve_path = nullptr;
+  const char* connect_path = nullptr;
+  bool shm_benchmark = false;
+  bool fork_benchmark = false;
+  int cache_benchmark_mb = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--frames" && i + 1 < argc) {
+      num_frames = atoi(argv[++i]);
+    } else if (arg == "--hashes" && i + 1 < argc) {
+      hashes_filename = argv[++i];
+    } else if (arg == "--trace-frame" && i + 1 < argc) {
+      trace_frame_index = atoi(argv[++i]);
+    } else if (arg == "--trace" && i + 1 < argc) {
+      trace_filename = argv[++i];
+    } else if (arg == "--trace-size" && i + 1 < argc) {
+      trace_size_log2 = atoi(argv[++i]);
+    } else if (arg == "--decode-trace" && i + 1 < argc) {
+      return TraceRecorder::decode(argv[++i], stdout) ? 0 : -1;
+    } else if (arg == "--perf-json" && i + 1 < argc) {
+      perf_filename = argv[++i];
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profile_filename = argv[++i];
+    } else if (arg == "--heatmap" && i + 1 < argc) {
+      heatmap_filename = argv[++i];
+    } else if (arg == "--run-ahead" && i + 1 < argc) {
+      run_ahead_frames = argv[++i];
+    } else if (arg == "--netplay-test" && i + 1 < argc) {
+      netplay_latency = atoi(argv[++i]);
+    } else if (arg == "--netplay-loss" && i + 1 < argc) {
+      netplay_loss = (float)atof(argv[++i]);
+    } else if (arg == "--netplay-udp" && i + 1 < argc) {
+      netplay_udp_port = atoi(argv[++i]);
+    } else if (arg == "--filter" && i + 1 < argc) {
+      if (!parse_video_filter(argv[++i], video_filter)) {
+        return -1;
+      }
+    } else if (arg == "--screenshot" && i + 1 < argc) {
+      screenshot_filename = argv[++i];
+    } else if (arg == "--palette" && i + 1 < argc) {
+      palette_filename = argv[++i];
+    } else if (arg == "--filter-benchmark") {
+      filter_benchmark = true;
+    } else if (arg == "--audio-analyze") {
+      audio_analyze = true;
+    } else if (arg == "--record-video" && i + 1 < argc) {
+      record_video_filename = argv[++i];
+    } else if (arg == "--record-audio" && i + 1 < argc) {
+      record_audio_filename = argv[++i];
+    } else if (arg == "--record-min-speed" && i + 1 < argc) {
+      record_min_speed = (float)atof(argv[++i]);
+    } else if (arg == "--no-idle-skip") {
+      idle_skip = false;
+    } else if (arg == "--idle-stats") {
+      idle_stats = true;
+    } else if (arg == "--test-input") {
+      test_inputs = true;
+    } else if (arg == "--skip-lag") {
+      test_inputs = true;
+      skip_lag = true;
+    } else if (arg == "--lag-stats") {
+      lag_stats = true;
+    } else if (arg == "--env-benchmark" && i + 1 < argc) {
+      env_benchmark_envs = atoi(argv[++i]);
+    } else if (arg == "--serve" && i + 1 < argc) {
+      serve_path = argv[++i];
+    } else if (arg == "--connect" && i + 1 < argc) {
+      connect_path = argv[++i];
+    } else if (arg == "--shm-benchmark") {
+      shm_benchmark = true;
+    } else if (arg == "--fork-benchmark") {
+      fork_benchmark = true;
+    } else if (arg == "--cache-benchmark" && i + 1 < argc) {
+      cache_benchmark_mb = atoi(argv[++i]);
+    } else if (arg == "--compare" && i + 2 < argc) {
+      compare_filenames[0] = argv[++i];
+      compare_filenames[1] = argv[++i];
+    } else if (arg[0] != '-' && rom == nullptr) {
+      rom = argv[i];
+    } else {
+      print_usage();
+      return -1;
+    }
+  }
+
+  if (compare_filenames[0]) {
+    trace_frame_index =
+        compare_hashes(compare_filenames[0], compare_filenames[1]);
+    if (trace_frame_index < 0 || rom == nullptr) {
+      return trace_frame_index < 0 ? 0 : 1;
+    }
+    num_frames = trace_frame_index + 1;
+  }
+  if (connect_path) {
+    return shm_client_benchmark(connect_path, num_frames) ? 0 : 1;
+  }
+  if (rom == nullptr) {
+    print_usage();
+    return -1;
+  }
+
+  if (netplay_latency >= 0) {
+    return netplay_test(rom, num_frames, netplay_latency, netplay_loss,
+                        netplay_udp_port);
+  }
+  if (env_benchmark_envs > 0) {
+    benchmark_env(rom, env_benchmark_envs, num_frames);
+    return 0;
+  }
+
+  auto nes = std::make_unique<NES>();
+  nes->load(rom);
+  if (!nes->loaded) {
+    return -1;
+  }
+  if (palette_filename) {
+    if (std::string(palette_filename) == "ntsc") {
+      nes->palette.generate();
+    } else if (!nes->palette.load(palette_filename)) {
+      return -1;
+    }
+  }
+
+  nes->cpu.idle_skip_enabled = idle_skip;
+
+  if (serve_path || shm_benchmark) {
+    ShmServer server(*nes);
+    std::string path =
+        serve_path ? serve_path : "/tmp/nes-headless-benchmark.sock";
+    if (!server.open(path.c_str())) {
+      return -1;
+    }
+    if (serve_path) {
+      printf("Serving %s on %s\n", rom, serve_path);
+      server.run();
+      return 0;
+    }
+    std::thread thread(&ShmServer::run, &server);
+    bool ok = shm_client_benchmark(path.c_str(), num_frames);
+    ShmClient quit;
+    if (quit.connect(path.c_str())) {
+      quit.request(NES_SHM_QUIT);
+    } else {
+      server.stop();
+    }
+    thread.join();
+    return ok ? 0 : 1;
+  }
+
+  FILE* hashes_file = nullptr;
+  if (hashes_filename) {
+    hashes_file = fopen(hashes_filename, "w");
+    if (!hashes_file) {
+      fprintf(stderr, "Could not open %s for writing\n", hashes_filename);
+      return -1;
+    }
+  }
+
+  if (trace_filename) {
+#ifndef NES_TRACE
+    fprintf(stderr, "Warning: built without NES_TRACE, trace will be empty\n");
+#endif
+    nes->tracer.start(trace_size_log2);
+  }
+
+  RunAhead run_ahead(*nes);
+  if (run_ahead_frames) {
+    if (std::string(run_ahead_frames) == "auto") {
+      run_ahead.auto_frames = true;
+    } else {
+      run_ahead.frames = atoi(run_ahead_frames);
+    }
+  }
+
+  std::unique_ptr<AudioAnalyzer> audio_analyzer;
+  if (audio_analyze) {
+    audio_analyzer = std::make_unique<AudioAnalyzer>(nes->apu.tap);
+  }
+
+  std::unique_ptr<AVRecorder> recorder;
+  if (record_video_filename || record_audio_filename) {
+    constexpr int record_sample_rate = 44100;
+    nes->apu.set_output_rate(record_sample_rate);
+    recorder = std::make_unique<AVRecorder>();
+    if (!recorder->open(record_video_filename, record_audio_filename,
+                        record_sample_rate, record_min_speed)) {
+      return -1;
+    }
+  }
+  auto start_time = std::chrono::steady_clock::now();
+
+  int inputs_read = 0;  // frames where the game read the joypads
+  int joypad_reads = 0;
+  int min_latch_cycle = INT_MAX;
+  int max_latch_cycle = -1;
+  double total_latch_cycles = 0;
+  int latches = 0;
+
+  for (int frame = 0; frame < num_frames; frame++) {
+    if (test_inputs) {
+      // Lag frames never see their input, so with --skip-lag the same input
+      // carries over to the next frame instead
+      int step = skip_lag ? inputs_read : frame;
+      nes->joypad.set_buttons(0, test_input(0, step));
+    }
+    if (frame == trace_frame_index) {
+      printf("Trace of frame %d:\n", frame);
+      trace_frame(*nes);
+    } else {
+      run_ahead.run_frame();
+    }
+    if (!nes->lag_frame()) {
+      const Joypad::Polls& polls = nes->joypad.polls;
+      inputs_read++;
+      joypad_reads += polls.reads;
+      if (polls.first_latch_cycle >= 0) {
+        min_latch_cycle = std::min(min_latch_cycle, polls.first_latch_cycle);
+        max_latch_cycle = std::max(max_latch_cycle, polls.first_latch_cycle);
+        total_latch_cycles += polls.first_latch_cycle;
+        latches++;
+      }
+    }
+    if (recorder) {
+      recorder->add_frame(nes->ppu.pixels, nes->apu.output_buffer.data(),
+                          nes->apu.output_buffer.size());
+    }
+    if (hashes_file) {
+      fprintf(hashes_file, "%d %016llx %016llx\n", frame,
+              (unsigned long long)nes->state_hash(),
+              (unsigned long long)video_hash(*nes));
+    }
+  }
+
+  std::chrono::duration<double> run_time =
+      std::chrono::steady_clock::now() - start_time;
+
+  if (hashes_file) {
+    fclose(hashes_file);
+  }
+  if (lag_stats) {
+    int lag_frames = num_frames - inputs_read;
+    printf("Lag frames: %d of %d (%.1f%%)\n", lag_frames, num_frames,
+           100.0 * lag_frames / num_frames);
+    if (inputs_read > 0) {
+      printf("  %.1f joypad reads per polled frame\n",
+             (double)joypad_reads / inputs_read);
+    }
+    if (latches > 0) {
+      printf("  first latch %d-%d cycles into the frame (mean %.0f)\n",
+             min_latch_cycle, max_latch_cycle, total_latch_cycles / latches);
+    }
+    if (test_inputs) {
+      printf("  %d inputs read, %.0f per second\n", inputs_read,
+             inputs_read / run_time.count());
+    }
+  }
+  if (recorder) {
+    recorder->close();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    const AVRecorder::Stats& stats = recorder->stats();
+    printf("Recorded %d frames (%d dropped) at %.1fx real time\n",
+           stats.frames_written, stats.frames_dropped,
+           num_frames / 60.0988 / elapsed.count());
+    printf("  blocked on the writer %.1f ms, writer busy %.1f ms\n",
+           stats.blocked_ms, stats.write_ms);
+  }
+  if (screenshot_filename) {
+    FilteredFrame frame;
+    apply_video_filter(video_filter, nes->ppu.pixels, frame);
+    if (!write_ppm(screenshot_filename, frame)) {
+      return -1;
+    }
+  }
+  if (filter_benchmark) {
+    benchmark_video_filters(nes->ppu.pixels);
+  }
+  if (fork_benchmark) {
+    benchmark_fork(*nes);
+  }
+  if (cache_benchmark_mb > 0) {
+    benchmark_cache(*nes, cache_benchmark_mb);
+  }
+  if (audio_analyzer) {
+    audio_analyzer->finish();
+  }
+  if (idle_stats) {
+    constexpr double cycles_per_frame = 29780.5;
+    double skipped = (double)nes->cpu.idle_cycles_skipped;
+    printf("Idle loops: %llu skips, %.0f cycles (%.1f%% of %d frames)\n",
+           (unsigned long long)nes->cpu.idle_skips, skipped,
+           100.0 * skipped / (num_frames * cycles_per_frame), num_frames);
+  }
+  if (run_ahead_frames) {
+    printf("Run-ahead: %d frames\n", run_ahead.frames);
+    printf("  frame %.3f ms, hidden frame %.3f ms, snapshot %.3f ms\n",
+           run_ahead.frame_ms, run_ahead.hidden_frame_ms,
+           run_ahead.snapshot_ms);
+    for (int n = 0; n <= RunAhead::max_frames; n++) {
+      printf("  %d frames: %.3f ms per host frame\n", n, run_ahead.cost_ms(n));
+    }
+  }
+  if (trace_filename) {
+    printf("Saving %llu trace records to %s\n",
+           (unsigned long long)nes->tracer.size(), trace_filename);
+    nes->tracer.save(trace_filename);
+  }
+  if (perf_filename) {
+#ifndef NES_PERF_COUNTERS
+    fprintf(stderr, "Warning: built without NES_PERF_COUNTERS\n");
+#endif
+    FILE* perf_file = fopen(perf_filename, "w");
+    if (!perf_file) {
+      fprintf(stderr, "Could not open %s for writing\n", perf_filename);
+      return -1;
+    }
+    fputs(nes->perf.to_json().c_str(), perf_file);
+    fclose(perf_file);
+  }
+#ifndef NES_PROFILE
+  if (profile_filename || heatmap_filename) {
+    fprintf(stderr, "Warning: built without NES_PROFILE\n");
+  }
+#endif
+  if (profile_filename) {
+    FILE* profile_file = fopen(profile_filename, "w");
+    if (!profile_file) {
+      fprintf(stderr, "Could not open %s for writing\n", profile_filename);
+      return -1;
+    }
+    nes->profiler.write_report(profile_file);
+    fclose(profile_file);
+  }
+  if (heatmap_filename) {
+    FILE* heatmap_file = fopen(heatmap_filename, "wb");
+    if (!heatmap_file) {
+      fprintf(stderr, "Could not open %s for writing\n", heatmap_filename);
+      return -1;
+    }
+    static uint8_t heatmap[0x10000];
+    nes->profiler.heatmap(heatmap);
+    fwrite(heatmap, sizeof(heatmap), 1, heatmap_file);
+    fclose(heatmap_file);
+  }
+  return 0;
+}
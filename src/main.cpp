@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <stdexcept>
 #include "audio.h"
+#include "emulation_thread.h"
 #include "nes/nes.h"
 #include "renderer.h"
 
@@ -10,8 +11,12 @@
 #endif
 
 NES nes;
-Renderer renderer(nes);
 Audio audio(nes);
+EmulationThread emulation(nes, audio);
+Renderer renderer(nes, emulation);
+
+#ifdef __EMSCRIPTEN__
+// Without threads, emulation and rendering share the browser's main loop
 double last_time = 0.0f;
 double accumulator = 0.0f;
 
@@ -26,12 +31,12 @@ void loop() {
   }
   accumulator = std::min(accumulator + delta, target_frame_time * 3);
   while (accumulator >= target_frame_time) {
-    nes.run_frame();
-    audio.output();
+    emulation.run_frame();
     accumulator -= target_frame_time;
   }
   renderer.render();
 }
+#endif
 
 int main(int argc, char* agv[]) {
   if (!renderer.init()) {
@@ -46,9 +51,11 @@ int main(int argc, char* agv[]) {
 #ifdef __EMSCRIPTEN__
   emscripten_set_main_loop(&loop, 0, 1);
 #else
+  emulation.start();
   while (!renderer.done()) {
-    loop();
+    renderer.render();
   }
+  emulation.stop();
 #endif
 
   renderer.destroy();
@@ -1,4 +1,6 @@
 #include "apu.h"
+#include <algorithm>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include "nes.h"
@@ -6,6 +8,9 @@
 namespace {
 
 constexpr int cpu_rate = 1789773;
+constexpr double capture_rate = cpu_rate / 2.0;
+// Weight of each channel in its mixer group's table index
+const int mixer_weights[5] = {1, 1, 3, 2, 1};
 const int frame_counter_cycles[2][4] = {
     {7457, 14913, 22371, 29829},
     {7457, 14913, 22371, 37281},
@@ -37,8 +42,8 @@ float tnd_table[203];
 
 }  // namespace
 
-APU::APU(NES& nes) : nes(nes), dmc(nes) {
-  set_sample_rate(44100);
+APU::APU(NES& nes) : tap(capture_rate), nes(nes), dmc(nes) {
+  set_output_rate(44100);
 
   pulse[0].sweep_negate_tweak = 1;
 
@@ -50,17 +55,12 @@ APU::APU(NES& nes) : nes(nes), dmc(nes) {
   for (int i = 1; i <= 202; i++) {
     tnd_table[i] = 163.67f / (24329.0f / i + 100);
   }
-
-  debug_waveforms[0] = WaveformCapture(15, 1);
-  debug_waveforms[1] = WaveformCapture(15, 1);
-  debug_waveforms[2] = WaveformCapture(15, 8);
-  debug_waveforms[3] = WaveformCapture(15, 1);
-  debug_waveforms[4] = WaveformCapture(127, 1);
 }
 
 void APU::power_on() {
   cycle = 0;
-  memset(output_buffer, 0x00, sizeof(output_buffer));
+  output_buffer.clear();
+  capture_buffer.clear();
 
   port_write(0x4017, 0x00);
   port_write(0x4015, 0x00);
@@ -191,11 +191,10 @@ void APU::tick() {
   triangle.update_timer();
   dmc.update_timer();
 
-  // Sample and mix output
-  sample_cycle++;
-  if (sample_cycle >= cycles_per_sample) {
-    sample_cycle -= cycles_per_sample;
-    sample();
+  // Capture output
+  capture_phase = !capture_phase;
+  if (output_enabled && capture_phase) {
+    capture();
   }
 
   // Set IRQ
@@ -203,47 +202,116 @@ void APU::tick() {
   nes.cpu.set_irq(IRQType::APU_DMC, dmc.interrupt_flag);
 }
 
-void APU::sample() {
-  uint8_t pulse_index = 0;
-  for (int i = 0; i < 2; i++) {
-    uint8_t pulse_out = pulse[i].output();
-    pulse_index += pulse_out;
-    debug_waveforms[i].add_sample(pulse_out);
+int APU::idle_cycles(bool irqs) {
+  int cycles = INT_MAX;
+  if (dmc.bytes_left > 0) {
+    // The output unit clocks on the tick after timer reaches 0
+    cycles = dmc.timer;
+  }
+  if (irqs) {
+    // Steps happen on the tick where cycle matches the table
+    cycles = std::min(
+        cycles, frame_counter_cycles[frame_counter_mode][frame_counter_step] -
+                    cycle);
   }
-  uint8_t tnd_index = 0;
+  return cycles;
+}
 
-  uint8_t triangle_out = triangle.output();
-  tnd_index += triangle_out * 3;
-  debug_waveforms[2].add_sample(triangle_out);
+void APU::capture() {
+  ChannelLevels levels;
+  levels.level[0] = pulse[0].output();
+  levels.level[1] = pulse[1].output();
+  levels.level[2] = triangle.output();
+  levels.level[3] = noise.output();
+  levels.level[4] = dmc.output();
+  capture_buffer.push_back(levels);
+}
 
-  uint8_t noise_out = noise.output();
-  tnd_index += noise_out * 2;
-  debug_waveforms[3].add_sample(noise_out);
+void APU::end_frame() {
+  int count = capture_buffer.size();
+  for (int c = 0; c < 2; c++) {
+    mix_buffer[c].resize(count);
+  }
 
-  uint8_t dmc_out = dmc.output();
-  tnd_index += dmc_out;
-  debug_waveforms[4].add_sample(dmc_out);
+  float gains[2][5];
+  bool stereo = false;
+  for (int i = 0; i < 5; i++) {
+    gains[0][i] = std::min(1.0f, 1.0f - pan[i]);
+    gains[1][i] = std::min(1.0f, 1.0f + pan[i]);
+    stereo |= pan[i] != 0.0f;
+  }
 
-  float pulse_out = pulse_table[pulse_index];
-  float tnd_out = tnd_table[tnd_index];
-  if (sample_count < max_output_buffer_size) {
-    output_buffer[sample_count++] = (pulse_out + tnd_out) * max_volume;
+  for (int i = 0; i < count; i++) {
+    const uint8_t* level = capture_buffer[i].level;
+    int pulse_index = level[0] + level[1];
+    int tnd_index = level[2] * 3 + level[3] * 2 + level[4];
+    float pulse_out = pulse_table[pulse_index];
+    float tnd_out = tnd_table[tnd_index];
+    if (!stereo) {
+      mix_buffer[0][i] = mix_buffer[1][i] = pulse_out + tnd_out;
+    } else {
+      // The mixer is nonlinear, so split each group's output between its
+      // channels by their share of the table index
+      for (int c = 0; c < 2; c++) {
+        float pulse_gain = 0.0f;
+        float tnd_gain = 0.0f;
+        for (int j = 0; j < 2; j++) {
+          pulse_gain += level[j] * mixer_weights[j] * gains[c][j];
+        }
+        for (int j = 2; j < 5; j++) {
+          tnd_gain += level[j] * mixer_weights[j] * gains[c][j];
+        }
+        float out = 0.0f;
+        if (pulse_index > 0) {
+          out += pulse_out * pulse_gain / pulse_index;
+        }
+        if (tnd_index > 0) {
+          out += tnd_out * tnd_gain / tnd_index;
+        }
+        mix_buffer[c][i] = out;
+      }
+    }
+  }
+  if (tap.active()) {
+    tap.publish(capture_buffer.data(), count);
   }
+  capture_buffer.clear();
+
+  output_buffer.clear();
+  resampler.process(mix_buffer[0].data(), mix_buffer[1].data(), count,
+                    max_volume, output_buffer);
 }
 
-void APU::clear_output_buffer() {
-  sample_count = 0;
+void APU::set_output_rate(int rate) {
+  resampler.configure(capture_rate, rate);
 }
 
 void APU::set_sample_rate(int rate) {
-  sample_rate = rate;
-  cycles_per_sample = (float)cpu_rate / sample_rate;
+  resampler.set_output_rate(rate);
 }
 
 void APU::set_volume(int16_t volume) {
   max_volume = volume;
 }
 
+void APU::set_pan(int channel, float value) {
+  pan[channel] = std::min(std::max(value, -1.0f), 1.0f);
+}
+
+void APU::visit_state(StateVisitor& v) {
+  v(cycle);
+  for (int i = 0; i < 2; i++) {
+    pulse[i].visit_state(v);
+  }
+  triangle.visit_state(v);
+  noise.visit_state(v);
+  dmc.visit_state(v);
+  v(frame_counter_step);
+  v(frame_counter_mode);
+  v(frame_counter_irq_inhibit);
+  v(frame_interrupt_flag);
+}
+
 void LengthCounter::load(uint8_t index) {
   if (enabled) {
     counter = length_table[index];
@@ -256,6 +324,10 @@ void LengthCounter::update() {
   }
 }
 
+void LengthCounter::visit_state(StateVisitor& v) {
+  v(counter);
+}
+
 void Envelope::load(uint8_t data) {
   constant_volume = (data >> 4) & 0x01;
   volume_or_period = data & 0x0F;
@@ -286,6 +358,14 @@ uint8_t Envelope::volume() {
   return constant_volume ? volume_or_period : decay_level_counter;
 }
 
+void Envelope::visit_state(StateVisitor& v) {
+  v(constant_volume);
+  v(volume_or_period);
+  v(start);
+  v(decay_level_counter);
+  v(divider);
+}
+
 void Pulse::write_register(uint16_t addr, uint8_t value) {
   switch (addr & 0xFFF3) {
     case 0x4000:
@@ -354,6 +434,24 @@ uint8_t Pulse::output() {
   return pulse_sequence[duty][sequence_counter] * envelope.volume();
 }
 
+void Pulse::visit_state(StateVisitor& v) {
+  v(enabled);
+  v(duty);
+  v(fc_halt_or_loop);
+  v(sweep);
+  v(sweep_period);
+  v(sweep_negate);
+  v(sweep_shift);
+  v(timer_period);
+  v(timer);
+  v(sequence_counter);
+  v(target_period);
+  v(sweep_divider);
+  v(sweep_reload);
+  length_counter.visit_state(v);
+  envelope.visit_state(v);
+}
+
 void Triangle::write_register(uint16_t addr, uint8_t value) {
   switch (addr) {
     case 0x4008:
@@ -398,6 +496,18 @@ uint8_t Triangle::output() {
   return triangle_sequence[sequence_counter];
 }
 
+void Triangle::visit_state(StateVisitor& v) {
+  v(enabled);
+  v(fc_halt_or_linear_control);
+  v(linear_counter_period);
+  v(timer_period);
+  v(timer);
+  v(sequence_counter);
+  v(linear_counter);
+  v(linear_counter_reload);
+  length_counter.visit_state(v);
+}
+
 void Noise::write_register(uint16_t addr, uint8_t value) {
   switch (addr) {
     case 0x400C:
@@ -431,6 +541,17 @@ uint8_t Noise::output() {
   return envelope.volume();
 }
 
+void Noise::visit_state(StateVisitor& v) {
+  v(enabled);
+  v(fc_halt_or_loop);
+  v(mode);
+  v(timer_period);
+  v(timer);
+  v(shift_register);
+  length_counter.visit_state(v);
+  envelope.visit_state(v);
+}
+
 void DMC::write_register(uint16_t addr, uint8_t value) {
   switch (addr) {
     case 0x4010:
@@ -460,6 +581,7 @@ void DMC::set_enabled(bool value) {
     if (bytes_left == 0) {
       restart_sample();
     }
+    request_fetch();
   } else {
     bytes_left = 0;
   }
@@ -470,24 +592,34 @@ void DMC::restart_sample() {
   bytes_left = sample_length;
 }
 
-void DMC::update_timer() {
-  // Memory reader
+void DMC::request_fetch() {
+  // The sample buffer only empties here or in the output unit, so the memory
+  // reader asks the CPU to stall for a fetch instead of polling every cycle
   if (!sample_buffer_filled && bytes_left > 0) {
-    // TODO: Emulate cpu stall
-    sample_buffer = nes.cpu.mem_read(current_address, false);
-    sample_buffer_filled = true;
-    if (++current_address == 0) {
-      current_address = 0x8000;
-    }
-    if (--bytes_left == 0) {
-      if (loop) {
-        restart_sample();
-      } else if (irq_enabled) {
-        interrupt_flag = true;
-      }
+    nes.cpu.request_dmc_dma();
+  }
+}
+
+void DMC::fetch() {
+  // Memory reader. The channel may have been disabled during the stall.
+  if (sample_buffer_filled || bytes_left == 0) {
+    return;
+  }
+  sample_buffer = nes.cpu.mem_read(current_address, false);
+  sample_buffer_filled = true;
+  if (++current_address == 0) {
+    current_address = 0x8000;
+  }
+  if (--bytes_left == 0) {
+    if (loop) {
+      restart_sample();
+    } else if (irq_enabled) {
+      interrupt_flag = true;
     }
   }
+}
 
+void DMC::update_timer() {
   // Output unit
   if (timer-- == 0) {
     timer = rate - 1;
@@ -499,6 +631,7 @@ void DMC::update_timer() {
         // Empty sample buffer into shift register
         shift_register = sample_buffer;
         sample_buffer_filled = false;
+        request_fetch();
       }
     }
     if (!silenced) {
@@ -517,4 +650,23 @@ uint8_t DMC::output() {
   // Note: The output level is sent to the mixer whether the channel is enabled
   // or not
   return output_level;
+}
+
+void DMC::visit_state(StateVisitor& v) {
+  v(enabled);
+  v(loop);
+  v(irq_enabled);
+  v(rate);
+  v(sample_address);
+  v(sample_length);
+  v(timer);
+  v(bytes_left);
+  v(current_address);
+  v(sample_buffer);
+  v(sample_buffer_filled);
+  v(interrupt_flag);
+  v(shift_register);
+  v(bits_left);
+  v(output_level);
+  v(silenced);
 }
\ No newline at end of file
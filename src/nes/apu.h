@@ -1,6 +1,9 @@
 #pragma once
 #include <cstdint>
-#include "waveform_capture.h"
+#include <vector>
+#include "audio_tap.h"
+#include "resampler.h"
+#include "state.h"
 
 class NES;
 
@@ -17,6 +20,7 @@ struct LengthCounter {
   }
   void load(uint8_t index);
   void update();
+  void visit_state(StateVisitor& v);
 };
 
 struct Envelope {
@@ -31,6 +35,7 @@ struct Envelope {
   void load(uint8_t data);
   void update();
   uint8_t volume();
+  void visit_state(StateVisitor& v);
 };
 
 struct Pulse {
@@ -62,6 +67,7 @@ struct Pulse {
   void update_sweep();
   void update_timer();
   uint8_t output();
+  void visit_state(StateVisitor& v);
 };
 
 struct Triangle {
@@ -84,6 +90,7 @@ struct Triangle {
   void update_linear_counter();
   void update_timer();
   uint8_t output();
+  void visit_state(StateVisitor& v);
 };
 
 struct Noise {
@@ -105,6 +112,7 @@ struct Noise {
   void update_length_counter();
   void update_timer();
   uint8_t output();
+  void visit_state(StateVisitor& v);
 };
 
 struct DMC {
@@ -134,38 +142,60 @@ struct DMC {
   void write_register(uint16_t addr, uint8_t value);
   void set_enabled(bool value);
   void restart_sample();
+  void request_fetch();
+  void fetch();
   void update_timer();
   uint8_t output();
+  void visit_state(StateVisitor& v);
 };
 
 class APU {
  public:
-  static constexpr int max_output_buffer_size = 1000;
-  int16_t output_buffer[max_output_buffer_size];
-  int sample_count = 0;
-  WaveformCapture debug_waveforms[5];
+  // Interleaved stereo samples of the last frame, replaced by end_frame()
+  std::vector<int16_t> output_buffer;
+  // Per-channel output for oscilloscopes, recorders, etc.
+  AudioTap tap;
+  bool output_enabled = true;  // false to skip capture, e.g. for run-ahead
 
   APU(NES& nes);
   void power_on();
-  void clear_output_buffer();
+  // Rebuilds the resampler for a new output rate, up to 96 kHz
+  void set_output_rate(int rate);
+  // Small adjustments around the output rate, e.g. to track the audio queue
   void set_sample_rate(int rate);
   void set_volume(int16_t volume);
+  // -1 is full left, 1 is full right
+  void set_pan(int channel, float pan);
+  float get_pan(int channel) { return pan[channel]; }
+  // Mixes and resamples the frame's captured channel outputs
+  void end_frame();
+  void visit_state(StateVisitor& v);
 
   uint8_t port_read(uint16_t addr);
   void port_write(uint16_t addr, uint8_t value);
 
   void tick();
+  // Number of cycles that can run before the DMC could request a fetch or, if
+  // irqs is set, the frame counter could raise an IRQ
+  int idle_cycles(bool irqs);
+  // Called by the CPU once it has stalled for a DMC sample fetch
+  void dmc_fetch() { dmc.fetch(); }
 
  private:
   NES& nes;
 
   int cycle = 0;
-  float sample_cycle = 0;
-  int sample_rate;
-  float cycles_per_sample;
   int16_t max_volume = INT16_MAX;
 
-  void sample();
+  // Channel outputs are captured every other cycle, then mixed and
+  // resampled once per frame
+  bool capture_phase = false;
+  std::vector<ChannelLevels> capture_buffer;
+  std::vector<float> mix_buffer[2];
+  Resampler resampler;
+  float pan[5] = {0};
+
+  void capture();
 
   // Channels
   Pulse pulse[2];
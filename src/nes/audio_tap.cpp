@@ -0,0 +1,39 @@
+#include "audio_tap.h"
+#include <algorithm>
+
+std::shared_ptr<AudioTapReader> AudioTap::attach(int rate, size_t capacity) {
+  auto reader = std::make_shared<AudioTapReader>(input_rate / rate, capacity);
+  std::lock_guard<std::mutex> lock(mutex);
+  readers.push_back(reader);
+  reader_count = readers.size();
+  return reader;
+}
+
+void AudioTap::detach(const std::shared_ptr<AudioTapReader>& reader) {
+  std::lock_guard<std::mutex> lock(mutex);
+  readers.erase(std::remove(readers.begin(), readers.end(), reader),
+                readers.end());
+  reader_count = readers.size();
+}
+
+void AudioTap::publish(const ChannelLevels* levels, size_t count) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& reader : readers) {
+    // Decimate to the reader's rate by keeping one in every step captures
+    scratch.clear();
+    double phase = reader->phase;
+    for (size_t i = 0; i < count; i++) {
+      phase += 1.0;
+      if (phase >= reader->step) {
+        phase -= reader->step;
+        scratch.push_back(levels[i]);
+      }
+    }
+    reader->phase = phase;
+
+    size_t pushed = reader->ring.push(scratch.data(), scratch.size());
+    if (pushed < scratch.size()) {
+      reader->dropped_count += scratch.size() - pushed;
+    }
+  }
+}
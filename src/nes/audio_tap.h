@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ring_buffer.h"
+
+// Channel outputs for one capture step, in the order pulse 1, pulse 2,
+// triangle, noise, DMC
+struct ChannelLevels {
+  uint8_t level[5];
+};
+
+// One consumer of the tap, e.g. the UI oscilloscope or a recorder. Only the
+// consumer's own thread should read from it.
+class AudioTapReader {
+ public:
+  AudioTapReader(double step, size_t capacity) : ring(capacity), step(step) {}
+  // Returns the number of steps read
+  size_t read(ChannelLevels* out, size_t count) { return ring.pop(out, count); }
+  size_t available() const { return ring.size(); }
+  // Steps lost because the consumer fell behind
+  uint64_t dropped() const { return dropped_count.load(); }
+
+ private:
+  friend class AudioTap;
+  RingBuffer<ChannelLevels> ring;
+  double step;  // capture steps per published step
+  double phase = 0;
+  std::atomic<uint64_t> dropped_count{0};
+};
+
+// Fans the APU's per-channel capture out to any number of readers, each with
+// its own SPSC ring and sample rate. Costs a single atomic load per frame when
+// nothing is attached.
+class AudioTap {
+ public:
+  AudioTap(double input_rate) : input_rate(input_rate) {}
+  std::shared_ptr<AudioTapReader> attach(int rate, size_t capacity = 16384);
+  void detach(const std::shared_ptr<AudioTapReader>& reader);
+  bool active() const { return reader_count.load() > 0; }
+  // Called by the emulation thread with each frame's capture
+  void publish(const ChannelLevels* levels, size_t count);
+
+ private:
+  double input_rate;
+  // Only guards the reader list, which changes rarely. The samples themselves
+  // go through the lock-free rings.
+  std::mutex mutex;
+  std::vector<std::shared_ptr<AudioTapReader>> readers;
+  std::atomic<int> reader_count{0};
+  std::vector<ChannelLevels> scratch;
+};
@@ -5,13 +5,16 @@
 #include "nes.h"
 
 Mapper::Mapper(ROMData& rom_data)
-    : pgr_rom(std::move(rom_data.pgr_rom)),
-      chr_rom(std::move(rom_data.chr_rom)) {
+    : pgr_rom(std::make_shared<const std::vector<uint8_t>>(
+          std::move(rom_data.pgr_rom))),
+      chr_rom(std::make_shared<std::vector<uint8_t>>(
+          std::move(rom_data.chr_rom))) {
   uint8_t rom_ctrl1 = rom_data.header[6];
   uint8_t rom_ctrl2 = rom_data.header[7];
   num_ram_banks = std::max(1, (int)rom_data.header[8]);
   has_trainer = rom_ctrl1 & 0x04;
   has_ram = rom_ctrl1 & 0x02;
+  has_chr_ram = rom_data.header[5] == 0;
   mirror_mode =
       rom_ctrl1 & 0x01 ? MirrorMode::VERTICAL : MirrorMode::HORIZONTAL;
 }
@@ -23,7 +26,7 @@ uint8_t Mapper::mem_read(uint16_t addr) {
     return pgr_ram[addr - 0x6000];
   } else {
     addr -= 0x8000;
-    return pgr_rom[pgr_map[addr / 0x2000] + addr % 0x2000];
+    return (*pgr_rom)[pgr_map[addr / 0x2000] + addr % 0x2000];
   }
 }
 
@@ -35,12 +38,15 @@ void Mapper::mem_write(uint16_t addr, uint8_t value) {
 
 uint8_t Mapper::chr_mem_read(uint16_t addr) {
   addr &= 0x1FFF;
-  return chr_rom[chr_map[addr / 0x400] + addr % 0x400];
+  return (*chr_rom)[chr_map[addr / 0x400] + addr % 0x400];
 }
 
 void Mapper::chr_mem_write(uint16_t addr, uint8_t value) {
-  addr &= 0x1FFF;
-  chr_rom[chr_map[addr / 0x400] + addr % 0x400] = value;
+  // CHR ROM ignores writes, and may be shared with clones
+  if (has_chr_ram) {
+    addr &= 0x1FFF;
+    (*chr_rom)[chr_map[addr / 0x400] + addr % 0x400] = value;
+  }
 }
 
 void Mapper::set_pgr_map(uint16_t bank_size,
@@ -50,7 +56,10 @@ void Mapper::set_pgr_map(uint16_t bank_size,
   for (int i = 0; i < num_subbanks; i++) {
     int index = from_bank * num_subbanks + i;
     int addr = (to_bank * num_subbanks + i) * 0x2000;
-    if (index < 4 && addr < pgr_rom.size()) {
+    if (index < 4 && addr < pgr_rom->size()) {
+      if (nes && pgr_map[index] != addr) {
+        PERF_COUNT(nes->perf, bank_switches, 1);
+      }
       pgr_map[index] = addr;
     }
   }
@@ -63,7 +72,10 @@ void Mapper::set_chr_map(uint16_t bank_size,
   for (int i = 0; i < num_subbanks; i++) {
     int index = from_bank * num_subbanks + i;
     int addr = (to_bank * num_subbanks + i) * 0x400;
-    if (index < 8 && addr < chr_rom.size()) {
+    if (index < 8 && addr < chr_rom->size()) {
+      if (nes && chr_map[index] != addr) {
+        PERF_COUNT(nes->perf, bank_switches, 1);
+      }
       chr_map[index] = addr;
     }
   }
@@ -73,10 +85,21 @@ void Mapper::set_nes(NES* nes) {
   this->nes = nes;
 }
 
+void Mapper::visit_state(StateVisitor& v) {
+  v(pgr_ram);
+  v(pgr_map);
+  v(chr_map);
+  v(mirror_mode);
+  if (has_chr_ram) {
+    v.visit(chr_rom->data(), chr_rom->size());
+  }
+}
+
 // Dummy mapper for load failures
 class MapperDummy : public Mapper {
  public:
   MapperDummy() {}
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
   uint8_t mem_read(uint16_t addr) { return 0; }
   void mem_write(uint16_t addr, uint8_t value) {}
   uint8_t chr_mem_read(uint16_t addr) { return 0; }
@@ -86,7 +109,7 @@ class MapperDummy : public Mapper {
 class Mapper0 : public Mapper {
  public:
   Mapper0(ROMData& rom_data) : Mapper(rom_data) {
-    if (pgr_rom.size() == 0x8000) {  // 32kb
+    if (pgr_rom->size() == 0x8000) {  // 32kb
       set_pgr_map(0x8000, 0, 0);
     } else {  // 16kb
       set_pgr_map(0x4000, 0, 0);
@@ -94,6 +117,8 @@ class Mapper0 : public Mapper {
     }
     set_chr_map(0x2000, 0, 0);
   }
+
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
 };
 
 class Mapper1 : public Mapper {
@@ -103,10 +128,12 @@ class Mapper1 : public Mapper {
 
   Mapper1(ROMData& rom_data) : Mapper(rom_data) {
     set_pgr_map(0x4000, 0, 0);
-    set_pgr_map(0x4000, 1, pgr_rom.size() / 0x4000 - 1);
+    set_pgr_map(0x4000, 1, pgr_rom->size() / 0x4000 - 1);
     set_chr_map(0x2000, 0, 0);
   }
 
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
+
   void set_control(uint8_t value) {
     control = value;
     switch (control & 0x03) {
@@ -155,7 +182,7 @@ class Mapper1 : public Mapper {
     } else if (pgr_bank_mode == 3) {
       // Fix last bank at $C000 and switch 16 KB bank at $8000
       set_pgr_map(0x4000, 0, value & 0x0F);
-      set_pgr_map(0x4000, 1, pgr_rom.size() / 0x4000 - 1);
+      set_pgr_map(0x4000, 1, pgr_rom->size() / 0x4000 - 1);
     }
   }
 
@@ -190,16 +217,24 @@ class Mapper1 : public Mapper {
       }
     }
   }
+
+  void visit_state(StateVisitor& v) override {
+    Mapper::visit_state(v);
+    v(shift_register);
+    v(control);
+  }
 };
 
 class Mapper2 : public Mapper {
  public:
   Mapper2(ROMData& rom_data) : Mapper(rom_data) {
     set_pgr_map(0x4000, 0, 0);
-    set_pgr_map(0x4000, 1, pgr_rom.size() / 0x4000 - 1);
+    set_pgr_map(0x4000, 1, pgr_rom->size() / 0x4000 - 1);
     set_chr_map(0x2000, 0, 0);
   }
 
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
+
   void mem_write(uint16_t addr, uint8_t value) override {
     Mapper::mem_write(addr, value);
     if (addr >= 0x8000) {
@@ -213,6 +248,8 @@ class Mapper3 : public Mapper0 {
  public:
   Mapper3(ROMData& rom_data) : Mapper0(rom_data) {}
 
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
+
   void mem_write(uint16_t addr, uint8_t value) override {
     Mapper::mem_write(addr, value);
     if (addr >= 0x8000) {
@@ -231,10 +268,12 @@ class Mapper4 : public Mapper0 {
   uint8_t irq_counter = 0;
 
   Mapper4(ROMData& rom_data) : Mapper0(rom_data) {
-    set_pgr_map(0x2000, 3, pgr_rom.size() / 0x2000 - 1);
+    set_pgr_map(0x2000, 3, pgr_rom->size() / 0x2000 - 1);
     set_banks();
   }
 
+  std::unique_ptr<Mapper> clone() const override { return clone_as(*this); }
+
   void mem_write(uint16_t addr, uint8_t value) override {
     if (addr < 0x8000) {
       Mapper::mem_write(addr, value);
@@ -283,6 +322,15 @@ class Mapper4 : public Mapper0 {
     }
   }
 
+  void visit_state(StateVisitor& v) override {
+    Mapper::visit_state(v);
+    v(bank_select);
+    v(bank_registers);
+    v(irq_period);
+    v(irq_enabled);
+    v(irq_counter);
+  }
+
   void set_banks() {
     uint8_t chr_mode = (bank_select >> 7) & 0x01;
     uint8_t pgr_mode = (bank_select >> 6) & 0x01;
@@ -304,9 +352,9 @@ class Mapper4 : public Mapper0 {
     if (pgr_mode == 0) {
       set_pgr_map(0x2000, 0, bank_registers[6] & 0x3F);
       set_pgr_map(0x2000, 1, bank_registers[7] & 0x3F);
-      set_pgr_map(0x2000, 2, pgr_rom.size() / 0x2000 - 2);
+      set_pgr_map(0x2000, 2, pgr_rom->size() / 0x2000 - 2);
     } else {
-      set_pgr_map(0x2000, 0, pgr_rom.size() / 0x2000 - 2);
+      set_pgr_map(0x2000, 0, pgr_rom->size() / 0x2000 - 2);
       set_pgr_map(0x2000, 1, bank_registers[7] & 0x3F);
       set_pgr_map(0x2000, 2, bank_registers[6] & 0x3F);
     }
@@ -405,4 +453,10 @@ MirrorMode Cartridge::get_mirror_mode() {
 
 void Cartridge::signal_scanline() {
   mapper->signal_scanline();
+}
+
+void Cartridge::visit_state(StateVisitor& v) {
+  if (mapper) {
+    mapper->visit_state(v);
+  }
 }
\ No newline at end of file
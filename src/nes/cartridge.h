@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 #include "ppu.h"
+#include "state.h"
 
 class NES;
 
@@ -15,15 +16,18 @@ struct ROMData {
 class Mapper {
  public:
   NES* nes = nullptr;
-  std::vector<uint8_t> pgr_rom;
-  std::vector<uint8_t> chr_rom;
-  uint8_t pgr_ram[0x2000];  // 8kb
-  int pgr_map[4];           // 8kb (0x2000) blocks
-  int chr_map[8];           // 1kb (0x400) blocks
+  // Shared by every clone() of the mapper. When the cartridge has CHR RAM
+  // instead of ROM, each clone has its own chr_rom.
+  std::shared_ptr<const std::vector<uint8_t>> pgr_rom;
+  std::shared_ptr<std::vector<uint8_t>> chr_rom;
+  uint8_t pgr_ram[0x2000] = {0};  // 8kb
+  int pgr_map[4];                 // 8kb (0x2000) blocks
+  int chr_map[8];                 // 1kb (0x400) blocks
 
   int num_ram_banks = 0;
   bool has_trainer = false;
   bool has_ram = false;
+  bool has_chr_ram = false;
   MirrorMode mirror_mode = MirrorMode::VERTICAL;
 
   Mapper() = default;
@@ -39,6 +43,20 @@ class Mapper {
   void set_chr_map(uint16_t bank_size, uint8_t from_bank, uint8_t to_bank);
   void set_nes(NES* nes);
   virtual void signal_scanline() {}
+  virtual void visit_state(StateVisitor& v);
+  // A copy of the mapper and its state, still pointing at the same NES. Each
+  // mapper implements it with clone_as(*this).
+  virtual std::unique_ptr<Mapper> clone() const = 0;
+
+ protected:
+  template <typename T>
+  static std::unique_ptr<Mapper> clone_as(const T& mapper) {
+    std::unique_ptr<T> copy = std::make_unique<T>(mapper);
+    if (copy->has_chr_ram) {
+      copy->chr_rom = std::make_shared<std::vector<uint8_t>>(*mapper.chr_rom);
+    }
+    return copy;
+  }
 };
 
 class Cartridge {
@@ -56,4 +74,5 @@ class Cartridge {
 
   MirrorMode get_mirror_mode();
   void signal_scanline();
+  void visit_state(StateVisitor& v);
 };
@@ -1,4 +1,6 @@
 #include "cpu.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include "nes.h"
@@ -17,6 +19,12 @@ void CPU::power_on() {
 
   do_nmi = false;
   do_irq = false;
+  dmc_dma_pending = false;
+  dmc_dma_writes = 0;
+  ppu_quiet_dots = 0;
+  ppu_pending_dots = 0;
+  ppu_busy_dots = 0;
+  reset_idle_loop();
   for (int i = 0; i < IRQType::Count; i++) {
     irq_levels[i] = false;
   }
@@ -32,8 +40,38 @@ void CPU::execute() {
     return;
   }
 
+#ifdef NES_TRACE
+  if (nes.tracer.enabled()) {
+    nes.tracer.add(trace_record());
+  }
+#endif
+
+  PERF_COUNT(nes.perf, instructions, 1);
+
+#ifdef NES_PROFILE
+  uint16_t profile_PC = PC;
+  int profile_cycles = cycles;
+#endif
+
+  if (idle_loop.recording) {
+    update_idle_loop();
+  }
+  uint16_t start_PC = PC;
+
   // Fetch opcode, increment PC
   uint8_t op = mem_read(PC++);
+  if (idle_loop.recording) {
+    switch (op) {
+      case 0x00:  // BRK
+      case 0x28:  // PLP
+      case 0x40:  // RTI
+      case 0x58:  // CLI
+      case 0x78:  // SEI
+        // These change the interrupt flag, which the skip relies on
+        idle_loop.clean = false;
+        break;
+    }
+  }
 
   uint16_t addr;
   switch (op) {
@@ -47,16 +85,60 @@ void CPU::execute() {
 
 #undef X
   }
+
+  // A short backward jump or branch is a candidate idle loop
+  constexpr int max_idle_loop_size = 16;
+  if (PC <= start_PC && start_PC - PC <= max_idle_loop_size &&
+      idle_skip_enabled && !(idle_loop.recording && idle_loop.head == PC)) {
+    idle_loop.recording = true;
+    idle_loop.clean = false;
+    idle_loop.head = PC;
+    idle_loop.instructions = 0;
+  }
+
+#ifdef NES_PROFILE
+  nes.profiler.add(profile_PC, op, cycles - profile_cycles);
+#endif
 }
 
 void CPU::print_state() {
-  printf(
-      "%04X                                            A:%02X X:%02X Y:%02X "
-      "P:%02X SP:%02X PPU:  0, 21 CYC:%d\n",
-      PC, A, X, Y, P.raw, SP, cycles);
-  /*
-  printf("A=0x%02x X=0x%02x Y=0x%02x P=0x%02x SP=0x%02x PC=0x%04x\n", A, X, Y,
-         P, SP, PC);*/
+  printf("%s\n", format_trace_record(trace_record()).c_str());
+}
+
+TraceRecord CPU::trace_record() {
+  sync_ppu();
+  TraceRecord record;
+  record.cycles = cycles;
+  record.PC = PC;
+  record.scanline = nes.ppu.get_scanline();
+  record.scanline_cycle = nes.ppu.get_scanline_cycle();
+  record.opcode[0] = peek(PC);
+  record.opcode[1] = peek(PC + 1);
+  record.opcode[2] = peek(PC + 2);
+  record.A = A;
+  record.X = X;
+  record.Y = Y;
+  record.P = P.raw;
+  record.SP = SP;
+  record.reserved[0] = 0;
+  record.reserved[1] = 0;
+  return record;
+}
+
+void CPU::visit_state(StateVisitor& v) {
+  v(A);
+  v(X);
+  v(Y);
+  v(PC);
+  v(SP);
+  v(P);
+  v(RAM);
+  v(cycles);
+  v(do_nmi);
+  v(do_irq);
+  v(irq_levels);
+  v(dmc_dma_pending);
+  v(dmc_dma_writes);
 }
 
 void CPU::set_cv(uint8_t a, uint8_t b, uint16_t res) {
@@ -80,13 +162,28 @@ void CPU::set_n(uint8_t a) {
 uint8_t CPU::mem_read(uint16_t addr, bool do_tick) {
   // TODO: Move into a separate bus class?
   if (do_tick) {
+    if (dmc_dma_pending) {
+      DMC_DMA();
+    }
     tick();
+    if (idle_loop.recording && addr >= 0x2000 && addr < 0x6000) {
+      if ((addr & 0xE007) == 0x2002) {
+        // PPUSTATUS polls are fine, since the PPU can tell when the result
+        // changes next. The read clears the vblank flag.
+        idle_loop.reads_status = true;
+        idle_loop.status = nes.ppu.peek_status() & 0x7F;
+      } else {
+        // Other registers may have read side effects or change on their own
+        idle_loop.clean = false;
+      }
+    }
   }
   if (addr <= 0x1FFF) {
     // 2KB internal RAM, 0x800 bytes mirrored 3 times
     return RAM[addr & 0x07FF];
   } else if (addr <= 0x3FFF) {
     // PPU registers, 8 bytes mirrored
+    sync_ppu();
     return nes.ppu.port_read(addr & 0x2007);
   } else if (addr <= 0x401F) {
     // APU and I/O registers, 32 bytes
@@ -102,17 +199,31 @@ uint8_t CPU::mem_read(uint16_t addr, bool do_tick) {
   }
 }
 
+uint8_t CPU::peek(uint16_t addr) {
+  // Read without ticking or triggering any register side effects
+  if (addr <= 0x1FFF) {
+    return RAM[addr & 0x07FF];
+  } else if (addr >= 0x6000) {
+    return nes.cartridge.mem_read(addr);
+  }
+  return 0;
+}
+
 uint16_t CPU::mem_read16(uint16_t addr) {
   return mem_read(addr) | (mem_read(addr + 1) << 8);
 }
 
 void CPU::mem_write(uint16_t addr, uint8_t value) {
+  // The CPU can't be halted on a write, so a pending DMC fetch waits
+  dmc_dma_writes += dmc_dma_pending;
+  idle_loop.clean = false;
   tick();
   if (addr <= 0x1FFF) {
     // 2KB internal RAM, 0x800 bytes mirrored 3 times
     RAM[addr & 0x07FF] = value;
   } else if (addr <= 0x3FFF) {
     // PPU registers, 8 bytes mirrored
+    sync_ppu();
     nes.ppu.port_write(addr & 0x2007, value);
   } else if (addr <= 0x401F) {
     // APU and I/O registers, 32 bytes
@@ -124,6 +235,8 @@ void CPU::mem_write(uint16_t addr, uint8_t value) {
       nes.joypad.port_write(addr, value);
     }
   } else {
+    // Mappers can switch what the PPU sees or watch its address bus
+    sync_ppu();
     nes.cartridge.mem_write(addr, value);
   }
 }
@@ -137,12 +250,106 @@ uint8_t CPU::stack_pop() {
 }
 
 void CPU::tick() {
-  nes.ppu.tick();
-  nes.ppu.tick();
-  nes.ppu.tick();
+  if (ppu_quiet_dots >= 3) {
+    ppu_quiet_dots -= 3;
+    ppu_pending_dots += 3;
+  } else {
+    if (ppu_pending_dots > 0) {
+      sync_ppu();
+    }
+    nes.ppu.tick();
+    nes.ppu.tick();
+    nes.ppu.tick();
+    if (ppu_busy_dots > 3) {
+      ppu_busy_dots -= 3;
+    } else {
+      ppu_quiet_dots = nes.ppu.quiet_dots();
+      ppu_busy_dots = nes.ppu.busy_dots();
+    }
+  }
 
   nes.apu.tick();
   cycles++;
+  PERF_COUNT(nes.perf, cycles, 1);
+}
+
+void CPU::advance(int count) {
+  // The PPU and APU only talk to the CPU, so each can run the whole span on
+  // its own
+  ppu_pending_dots += count * 3;
+  sync_ppu();
+  for (int i = 0; i < count; i++) {
+    nes.apu.tick();
+  }
+  cycles += count;
+  PERF_COUNT(nes.perf, cycles, count);
+}
+
+void CPU::sync_ppu() {
+  if (ppu_pending_dots > 0) {
+    nes.ppu.advance(ppu_pending_dots);
+    ppu_pending_dots = 0;
+  }
+  // A write could have toggled rendering
+  ppu_quiet_dots = 0;
+  ppu_busy_dots = 0;
+}
+
+void CPU::update_idle_loop() {
+  constexpr int max_idle_loop_instructions = 8;
+  if (PC != idle_loop.head) {
+    if (++idle_loop.instructions > max_idle_loop_instructions) {
+      idle_loop.recording = false;
+    }
+    return;
+  }
+
+  uint8_t registers[5] = {A, X, Y, P.raw, SP};
+  if (idle_loop.clean &&
+      memcmp(registers, idle_loop.registers, sizeof(registers)) == 0) {
+    skip_idle_loop(cycles - idle_loop.start_cycles);
+  }
+  // Start another pass
+  memcpy(idle_loop.registers, registers, sizeof(registers));
+  idle_loop.clean = true;
+  idle_loop.reads_status = false;
+  idle_loop.start_cycles = cycles;
+  idle_loop.instructions = 0;
+}
+
+void CPU::skip_idle_loop(int loop_cycles) {
+#ifdef NES_PROFILE
+  // The profile should still see every pass
+  return;
+#endif
+#ifdef NES_TRACE
+  if (nes.tracer.enabled()) {
+    return;
+  }
+#endif
+  if (dmc_dma_pending || loop_cycles <= 0) {
+    return;
+  }
+  sync_ppu();
+  // Whole passes that fit before the PPU or APU could interrupt the loop,
+  // raise an IRQ it would take, request a DMC fetch or end the frame
+  bool irqs = !P.I;
+  int budget =
+      std::min(nes.ppu.idle_dots(irqs) / 3, nes.apu.idle_cycles(irqs));
+  if (idle_loop.reads_status) {
+    // Each skipped poll has to read what the last one left behind
+    if (nes.ppu.peek_status() != idle_loop.status) {
+      return;
+    }
+    budget = std::min(budget, nes.ppu.status_dots() / 3);
+  }
+  int passes = budget / loop_cycles;
+  if (passes <= 0) {
+    return;
+  }
+  advance(passes * loop_cycles);
+  idle_skips++;
+  idle_cycles_skipped += passes * loop_cycles;
 }
 
 void CPU::request_nmi() {
@@ -165,6 +372,7 @@ void CPU::set_irq(IRQType::Values type, bool value) {
 }
 
 void CPU::NMI() {
+  PERF_COUNT(nes.perf, nmis, 1);
   stack_push(PC >> 8);
   stack_push(PC & 0xFF);
   stack_push(P.raw);
@@ -175,6 +383,7 @@ void CPU::NMI() {
 }
 
 void CPU::IRQ(bool brk) {
+  PERF_COUNT(nes.perf, irqs, brk ? 0 : 1);
   stack_push(PC >> 8);
   stack_push(PC & 0xFF);
   stack_push(P.raw | (brk ? 0x10 : 0x00));
@@ -187,11 +396,60 @@ void CPU::IRQ(bool brk) {
 }
 
 void CPU::OAM_DMA(uint8_t addr_hi) {
-  // TODO: handle odd extra cycle
+  // Copy the whole page at once. Pages outside RAM go through the memory map
+  // in case they have side effects, but still without ticking.
   uint16_t addr = addr_hi << 8;
-  for (int i = 0; i < 256; i++) {
-    // Simulate with an OAMDATA write to the ppu
-    mem_write(0x2004, mem_read(addr + i));
+  uint8_t data[256];
+  if (addr <= 0x1FFF) {
+    memcpy(data, &RAM[addr & 0x07FF], 256);
+  } else {
+    for (int i = 0; i < 256; i++) {
+      data[i] = mem_read(addr + i, false);
+    }
+  }
+  sync_ppu();
+  nes.ppu.oam_dma(data);
+
+  // The CPU halts for a cycle, plus one more to align to a read cycle if the
+  // halt lands on an odd cycle, then takes 256 read/write pairs
+  int stall_cycles = 1 + (cycles & 1) + 512;
+  PERF_COUNT(nes.perf, dma_stall_cycles, stall_cycles);
+  dma_in_progress = true;
+  if (dmc_dma_pending) {
+    dmc_dma_pending = false;
+    request_dmc_dma();
+  }
+  advance(stall_cycles);
+  while (dma_extra_cycles > 0) {
+    int count = dma_extra_cycles;
+    dma_extra_cycles = 0;
+    advance(count);
+  }
+  dma_in_progress = false;
+}
+
+void CPU::DMC_DMA() {
+  // The stall lengthens this pass of any idle loop, so it can't be used to
+  // measure one
+  idle_loop.clean = false;
+  // 4 cycles, less any write cycles the halt had to wait for
+  dmc_dma_pending = false;
+  int stall_cycles = std::max(1, 4 - dmc_dma_writes);
+  PERF_COUNT(nes.perf, dma_stall_cycles, stall_cycles);
+  advance(stall_cycles);
+  nes.apu.dmc_fetch();
+}
+
+void CPU::request_dmc_dma() {
+  if (dma_in_progress) {
+    // OAM DMA is already halting the CPU, so the fetch takes its own cycles
+    // out of the middle of the transfer
+    nes.apu.dmc_fetch();
+    PERF_COUNT(nes.perf, dma_stall_cycles, 2);
+    dma_extra_cycles += 2;
+  } else if (!dmc_dma_pending) {
+    dmc_dma_pending = true;
+    dmc_dma_writes = 0;
   }
 }
 
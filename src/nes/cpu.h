@@ -1,6 +1,8 @@
 #pragma once
 #include <cstdint>
 #include "bitfield.h"
+#include "state.h"
+#include "trace.h"
 
 struct IRQType {
   enum Values {
@@ -38,13 +40,29 @@ class CPU {
 
   int cycles = 7;
   bool done = false;
+  bool dma_in_progress = false;  // OAM DMA has halted the CPU
+
+  // Idle loop skipping. Loops that only read memory without side effects and
+  // leave the registers unchanged are fast-forwarded to just before the next
+  // event that could end them, which gives the same result as running them.
+  bool idle_skip_enabled = true;
+  uint64_t idle_skips = 0;
+  uint64_t idle_cycles_skipped = 0;
+  // Call when the state changes under the CPU, e.g. loading a snapshot
+  void reset_idle_loop() { idle_loop.recording = false; }
+  // Runs the PPU dots tick() has held back. Call before looking at the PPU
+  // from outside the CPU.
+  void sync_ppu();
 
   CPU(NES& nes);
   void power_on();
   void execute();
   void print_state();
+  TraceRecord trace_record();
+  void visit_state(StateVisitor& v);
 
   uint8_t mem_read(uint16_t addr, bool do_tick = true);
+  uint8_t peek(uint16_t addr);
   uint16_t mem_read16(uint16_t addr);
   void mem_write(uint16_t addr, uint8_t value);
   void stack_push(uint8_t value);
@@ -52,6 +70,8 @@ class CPU {
 
   void request_nmi();
   void set_irq(IRQType::Values type, bool value);
+  // Stalls the CPU on its next read cycle to fetch a DMC sample
+  void request_dmc_dma();
 
  private:
   void set_cv(uint8_t a, uint8_t b, uint16_t res);
@@ -60,8 +80,38 @@ class CPU {
   void set_n(uint8_t a);
 
   void tick();
+  void advance(int count);
+
+  // While the PPU is in a quiet span (see PPU::quiet_dots()), tick() only
+  // counts up its dots, and sync_ppu() jumps over them in one go when the
+  // span ends or the CPU touches the PPU or mapper
+  int ppu_quiet_dots = 0;    // left in the span
+  int ppu_pending_dots = 0;  // held back so far
+  int ppu_busy_dots = 0;     // before it's worth asking for a span again
 
   void OAM_DMA(uint8_t addr_hi);
+  void DMC_DMA();
+
+  // Idle loop detection: a backward jump marks a candidate loop head, and if
+  // one pass from the head back to it was clean and left the registers
+  // unchanged, every following pass will be the same until an event
+  struct IdleLoop {
+    bool recording = false;
+    bool clean = false;
+    bool reads_status = false;  // polls PPUSTATUS
+    uint8_t status = 0;         // PPUSTATUS as the last poll left it
+    uint16_t head = 0;
+    int start_cycles = 0;
+    int instructions = 0;
+    uint8_t registers[5];
+  } idle_loop;
+  void update_idle_loop();
+  void skip_idle_loop(int loop_cycles);
+
+  // DMC DMA
+  bool dmc_dma_pending = false;
+  int dmc_dma_writes = 0;    // write cycles since the request
+  int dma_extra_cycles = 0;  // cycles DMC fetches add to an OAM DMA
 
   // interrupts
   bool do_nmi = false;
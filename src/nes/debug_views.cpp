@@ -0,0 +1,135 @@
+#include "debug_views.h"
+#include <algorithm>
+#include <cstring>
+#include "nes.h"
+
+namespace {
+
+// Tracks the changed tiles of each row of tiles, as a span
+struct RowSpans {
+  int min_x[60];
+  int max_x[60];
+
+  RowSpans() {
+    std::fill(std::begin(min_x), std::end(min_x), INT32_MAX);
+    std::fill(std::begin(max_x), std::end(max_x), -1);
+  }
+  void add(int row, int x) {
+    min_x[row] = std::min(min_x[row], x);
+    max_x[row] = std::max(max_x[row], x);
+  }
+  void get(int rows, std::vector<DirtyRect>& dirty) {
+    for (int row = 0; row < rows; row++) {
+      if (max_x[row] >= 0) {
+        dirty.push_back({min_x[row] * 8, row * 8,
+                         (max_x[row] - min_x[row] + 1) * 8, 8});
+      }
+    }
+  }
+};
+
+}  // namespace
+
+DebugViews::DebugViews(NES& nes) : nes(nes) {
+  memset(pattern_data, 0, sizeof(pattern_data));
+  memset(tile_changed, 0, sizeof(tile_changed));
+}
+
+void DebugViews::invalidate() {
+  nametables_valid = false;
+  pattern_tables_valid = false;
+}
+
+void DebugViews::update(std::vector<DirtyRect>& nametables_dirty,
+                        std::vector<DirtyRect>& pattern_tables_dirty) {
+  // Finds the changed pattern table tiles, which the nametables also need
+  update_pattern_tables(pattern_tables_dirty);
+  update_nametables(nametables_dirty);
+}
+
+void DebugViews::update_pattern_tables(std::vector<DirtyRect>& dirty) {
+  PPU& ppu = nes.ppu;
+  for (int tile = 0; tile < 512; tile++) {
+    uint8_t data[16];
+    for (int i = 0; i < 16; i++) {
+      data[i] = ppu.mem_read(tile * 16 + i);
+    }
+    tile_changed[tile] = memcmp(data, &pattern_data[tile * 16], 16) != 0;
+    if (tile_changed[tile]) {
+      memcpy(&pattern_data[tile * 16], data, 16);
+    }
+  }
+
+  RowSpans spans;
+  for (int tile = 0; tile < 512; tile++) {
+    if (!tile_changed[tile] && pattern_tables_valid) {
+      continue;
+    }
+    // Two 16x16 tile tables side by side
+    int x = (tile / 256) * 16 + tile % 16;
+    int y = (tile % 256) / 16;
+    nes.ppu.render_tile(tile * 16, 0, x * 8, y * 8, 256,
+                        &pattern_tables[0][0][0], true);
+    spans.add(y, x);
+  }
+  spans.get(16, dirty);
+  pattern_tables_valid = true;
+}
+
+void DebugViews::update_nametables(std::vector<DirtyRect>& dirty) {
+  PPU& ppu = nes.ppu;
+
+  // Anything that affects every tile
+  bool all = !nametables_valid;
+  uint8_t palette[32];
+  for (int i = 0; i < 32; i++) {
+    palette[i] = ppu.mem_read(0x3F00 + i);
+  }
+  if (memcmp(palette, palette_data, sizeof(palette)) != 0) {
+    memcpy(palette_data, palette, sizeof(palette));
+    all = true;
+  }
+  for (int i = 0; i < 64; i++) {
+    if (memcmp(palette_rgb[i], nes.palette.lut[i], 3) != 0) {
+      memcpy(palette_rgb[i], nes.palette.lut[i], 3);
+      all = true;
+    }
+  }
+  if (ppu.get_bg_pattern_table() != bg_pattern_table) {
+    bg_pattern_table = ppu.get_bg_pattern_table();
+    all = true;
+  }
+
+  RowSpans spans;
+  for (int i = 0; i < 4; i++) {
+    uint16_t base_addr = 0x2000 + i * 0x0400;
+    uint8_t data[0x400];
+    for (int j = 0; j < 0x400; j++) {
+      data[j] = ppu.mem_read(base_addr + j);
+    }
+    const uint8_t* old_data = nametable_data[i];
+    int start_x = (i % 2) * 32;
+    int start_y = (i / 2) * 30;
+    for (int y = 0; y < 30; y++) {
+      for (int x = 0; x < 32; x++) {
+        uint8_t tile_index = data[y * 32 + x];
+        int at_offset = 0x03C0 | ((y >> 2) << 3) | (x >> 2);
+        int pattern_tile = (bg_pattern_table >> 4) + tile_index;
+        if (!all && tile_index == old_data[y * 32 + x] &&
+            data[at_offset] == old_data[at_offset] &&
+            !tile_changed[pattern_tile]) {
+          continue;
+        }
+        int at_shift = (x & 0x0002) | ((y & 0x0002) << 1);
+        uint8_t palette_index = (data[at_offset] >> at_shift) & 0x03;
+        ppu.render_tile(bg_pattern_table | (tile_index << 4), palette_index,
+                        (start_x + x) * 8, (start_y + y) * 8, 512,
+                        &nametables[0][0][0]);
+        spans.add(start_y + y, start_x + x);
+      }
+    }
+    memcpy(nametable_data[i], data, sizeof(data));
+  }
+  spans.get(60, dirty);
+  nametables_valid = true;
+}
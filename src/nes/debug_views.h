@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+struct DirtyRect {
+  int x, y, w, h;
+};
+
+// Nametable and pattern table views for the debugger, rendered
+// incrementally. A copy of everything the views are drawn from (nametables,
+// pattern data, palettes) is kept, and each update only redraws the 8x8
+// tiles whose inputs changed. Nothing is tracked while emulating, so there's
+// no cost when the views aren't shown.
+class NES;
+class DebugViews {
+ public:
+  uint8_t nametables[480][512][3];
+  uint8_t pattern_tables[128][256][3];
+
+  DebugViews(NES& nes);
+  // Redraws the changed tiles, and adds the changed areas of each view to
+  // its list (at most one rect per row of tiles)
+  void update(std::vector<DirtyRect>& nametables_dirty,
+              std::vector<DirtyRect>& pattern_tables_dirty);
+  // Redraws everything on the next update
+  void invalidate();
+
+ private:
+  NES& nes;
+
+  bool nametables_valid = false;
+  bool pattern_tables_valid = false;
+  uint8_t nametable_data[4][0x400];  // as last drawn
+  uint8_t pattern_data[0x2000];
+  uint8_t palette_data[32];
+  uint8_t palette_rgb[64][3];
+  uint16_t bg_pattern_table = 0;
+  bool tile_changed[512];  // by pattern table tile, in this update
+
+  void update_pattern_tables(std::vector<DirtyRect>& dirty);
+  void update_nametables(std::vector<DirtyRect>& dirty);
+};
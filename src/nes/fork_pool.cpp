@@ -0,0 +1,16 @@
+#include "fork_pool.h"
+
+NES* ForkPool::fork(NES& nes) {
+  if (free_slots.empty()) {
+    slots.push_back(std::make_unique<NES>());
+    free_slots.push_back(slots.back().get());
+  }
+  NES* fork = free_slots.back();
+  free_slots.pop_back();
+  nes.fork(*fork, scratch);
+  return fork;
+}
+
+void ForkPool::release(NES* fork) {
+  free_slots.push_back(fork);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "nes.h"
+
+// NES objects to fork into, for searches that branch a state many times.
+// Released forks are reused, so once the pool has as many as are alive at
+// once, forking doesn't allocate.
+class ForkPool {
+ public:
+  // A fork of nes (see NES::fork()), to hand back with release()
+  NES* fork(NES& nes);
+  void release(NES* fork);
+  // NES objects allocated, in use or not
+  size_t size() const { return slots.size(); }
+  size_t in_use() const { return slots.size() - free_slots.size(); }
+  // Bytes of state copied by the last fork
+  size_t state_size() const { return scratch.size(); }
+
+ private:
+  std::vector<std::unique_ptr<NES>> slots;
+  std::vector<NES*> free_slots;
+  std::vector<uint8_t> scratch;
+};
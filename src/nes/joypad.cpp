@@ -1,7 +1,8 @@
 #include "joypad.h"
 #include <cstdio>
+#include "nes.h"
 
-Joypad::Joypad() {
+Joypad::Joypad(NES& nes) : nes(nes) {
   for (int i = 0; i < 2; i++) {
     shift_register[i] = 0;
     for (int j = 0; j < 8; j++) {
@@ -14,7 +15,9 @@ uint8_t Joypad::port_read(uint16_t addr) {
   if (!(addr == 0x4016 || addr == 0x4017)) {
     return 0;
   }
+  polls.reads++;
   if (strobe) {
+    record_latch();
     set_shift_registers();
   }
   int i = addr & 0x01;
@@ -27,16 +30,47 @@ void Joypad::port_write(uint16_t addr, uint8_t value) {
   if (addr == 0x4016) {
     bool new_strobe = value & 0x01;
     if (strobe && !new_strobe) {
+      record_latch();
+      if (input_provider) {
+        for (int i = 0; i < 2; i++) {
+          set_buttons(i, input_provider->buttons(i));
+        }
+      }
       set_shift_registers();
     }
     strobe = new_strobe;
   }
 }
 
+void Joypad::begin_frame() {
+  polls = Polls();
+  frame_start_cycles = nes.cpu.cycles;
+}
+
 void Joypad::set_button_state(int joypad, Button button, bool pressed) {
   button_state[joypad][(int)button] = pressed;
 }
 
+uint8_t Joypad::get_buttons(int joypad) {
+  uint8_t buttons = 0;
+  for (int i = 0; i < 8; i++) {
+    buttons |= button_state[joypad][i] << i;
+  }
+  return buttons;
+}
+
+void Joypad::set_buttons(int joypad, uint8_t buttons) {
+  for (int i = 0; i < 8; i++) {
+    button_state[joypad][i] = (buttons >> i) & 0x01;
+  }
+}
+
+void Joypad::visit_state(StateVisitor& v) {
+  // Note: button_state is host input rather than emulated state
+  v(strobe);
+  v(shift_register);
+}
+
 void Joypad::set_shift_registers() {
   for (int i = 0; i < 2; i++) {
     shift_register[i] = 0;
@@ -44,4 +78,10 @@ void Joypad::set_shift_registers() {
       shift_register[i] |= (button_state[i][j] << j);
     }
   }
-}
\ No newline at end of file
+}
+
+void Joypad::record_latch() {
+  if (polls.first_latch_cycle < 0) {
+    polls.first_latch_cycle = nes.cpu.cycles - frame_start_cycles;
+  }
+}
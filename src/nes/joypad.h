@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include "state.h"
 
 enum class Button : int {
   A = 0,
@@ -13,19 +14,50 @@ enum class Button : int {
   Count
 };
 
+// Supplies the buttons when the game latches the joypads, so a live frontend
+// can hand over its newest input instead of what it had when the frame
+// started. Called on whichever thread runs the emulator.
+class InputProvider {
+ public:
+  virtual ~InputProvider() = default;
+  // Bit mask indexed by Button
+  virtual uint8_t buttons(int joypad) = 0;
+};
+
+class NES;
 class Joypad {
  public:
-  Joypad();
+  // How the game polled the joypads during the current frame. This is host
+  // side bookkeeping rather than emulated state.
+  struct Polls {
+    int reads = 0;               // of $4016 and $4017
+    int first_latch_cycle = -1;  // CPU cycles into the frame, or -1
+  };
+  Polls polls;
+  // If set, replaces the button state whenever the strobe goes low
+  InputProvider* input_provider = nullptr;
+
+  Joypad(NES& nes);
+  // Resets polls, called at the start of each frame
+  void begin_frame();
 
   uint8_t port_read(uint16_t addr);
   void port_write(uint16_t addr, uint8_t value);
 
   void set_button_state(int joypad, Button button, bool pressed);
+  // All buttons of a joypad at once, as a bit mask indexed by Button
+  uint8_t get_buttons(int joypad);
+  void set_buttons(int joypad, uint8_t buttons);
+  void visit_state(StateVisitor& v);
 
  private:
+  NES& nes;
+  int frame_start_cycles = 0;
+
   bool strobe = false;
   uint8_t shift_register[2];
   bool button_state[2][8];
 
   void set_shift_registers();
+  void record_latch();
 };
@@ -6,17 +6,80 @@ void NES::load(const char* filename) {
     cpu.power_on();
     ppu.power_on();
     apu.power_on();
+#ifdef NES_PROFILE
+    profiler.reset();
+#endif
   }
 }
 
 void NES::run_frame() {
-  ppu.clear_pixels();
+  PERF_TIMER(perf, run_frame_ms);
+  if (ppu.output_enabled) {
+    ppu.clear_pixels();
+  }
   if (!loaded) {
     return;
   }
+  joypad.begin_frame();
   while (!ppu.frame_ready) {
     // Note: Emulated PPU and APU ticks are driven by the CPU
     cpu.execute();
   }
   ppu.frame_ready = false;
+  cpu.sync_ppu();
+  if (apu.output_enabled) {
+    apu.end_frame();
+  }
+  PERF_COUNT(perf, frames, 1);
+}
+
+void NES::visit_state(StateVisitor& v) {
+  cpu.sync_ppu();
+  cpu.visit_state(v);
+  ppu.visit_state(v);
+  apu.visit_state(v);
+  cartridge.visit_state(v);
+  joypad.visit_state(v);
+}
+
+void NES::save_state(std::vector<uint8_t>& out) {
+  StateWriter writer(out);
+  visit_state(writer);
+}
+
+bool NES::load_state(const std::vector<uint8_t>& in) {
+  StateReader reader(in);
+  visit_state(reader);
+  cpu.reset_idle_loop();
+  return reader.ok();
+}
+
+void NES::fork(NES& into, std::vector<uint8_t>& scratch) {
+  Mapper* mapper = cartridge.mapper.get();
+  Mapper* into_mapper = into.cartridge.mapper.get();
+  if (mapper && (!into_mapper || into_mapper->pgr_rom != mapper->pgr_rom)) {
+    into.cartridge.mapper = mapper->clone();
+    into.cartridge.mapper->set_nes(&into);
+    into.palette = palette;
+    // Sets up anything load_state() doesn't cover
+    into.cpu.power_on();
+    into.ppu.power_on();
+    into.apu.power_on();
+#ifdef NES_PROFILE
+    into.profiler.reset();
+#endif
+  }
+  into.loaded = loaded;
+  into.cpu.idle_skip_enabled = cpu.idle_skip_enabled;
+  into.ppu.output_enabled = ppu.output_enabled;
+  into.ppu.resolve_enabled = ppu.resolve_enabled;
+  into.apu.output_enabled = apu.output_enabled;
+  save_state(scratch);
+  into.load_state(scratch);
+}
+
+uint64_t NES::state_hash() {
+  StateHasher hasher;
+  visit_state(hasher);
+  return hasher.digest();
 }
\ No newline at end of file
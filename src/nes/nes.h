@@ -4,7 +4,11 @@
 #include "cartridge.h"
 #include "cpu.h"
 #include "joypad.h"
+#include "palette.h"
+#include "perf_counters.h"
 #include "ppu.h"
+#include "profiler.h"
+#include "trace.h"
 
 class NES {
  public:
@@ -13,9 +17,33 @@ class NES {
   APU apu;
   Cartridge cartridge;
   Joypad joypad;
+  Palette palette;
+  TraceRecorder tracer;
+  PerfCounters perf;
+  Profiler profiler;
   bool loaded = false;
 
-  NES() : cpu(*this), ppu(*this), apu(*this), cartridge(*this) {}
+  NES()
+      : cpu(*this),
+        ppu(*this),
+        apu(*this),
+        cartridge(*this),
+        joypad(*this),
+        profiler(*this) {}
   void load(const char* filename);
   void run_frame();
+  // Whether the game didn't read the joypads during the last frame, so any
+  // input given for it was never seen
+  bool lag_frame() { return joypad.polls.reads == 0; }
+  void visit_state(StateVisitor& v);
+  uint64_t state_hash();
+  // In-memory snapshots of the emulator state
+  void save_state(std::vector<uint8_t>& out);
+  bool load_state(const std::vector<uint8_t>& in);
+  // Turns into into a copy of this NES, e.g. to branch a search. The ROM is
+  // shared rather than copied and into's buffers are reused, so only the
+  // state from visit_state() is copied, through the scratch snapshot. The
+  // drawn frame isn't part of it, and the palette is only copied by the first
+  // fork into a NES.
+  void fork(NES& into, std::vector<uint8_t>& scratch);
 };
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "palette.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+
+const uint32_t default_palette[64] = {
+    0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000,
+    0x881400, 0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000,
+    0x000000, 0x000000, 0xBCBCBC, 0x0078F8, 0x0058F8, 0x6844FC, 0xD800CC,
+    0xE40058, 0xF83800, 0xE45C10, 0xAC7C00, 0x00B800, 0x00A800, 0x00A844,
+    0x008888, 0x000000, 0x000000, 0x000000, 0xF8F8F8, 0x3CBCFC, 0x6888FC,
+    0x9878F8, 0xF878F8, 0xF85898, 0xF87858, 0xFCA044, 0xF8B800, 0xB8F818,
+    0x58D854, 0x58F898, 0x00E8D8, 0x787878, 0x000000, 0x000000, 0xFCFCFC,
+    0xA4E4FC, 0xB8B8F8, 0xD8B8F8, 0xF8B8F8, 0xF8A4C0, 0xF0D0B0, 0xFCE0A8,
+    0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000,
+    0x000000,
+};
+
+// How much emphasis dims the channels that aren't emphasized
+constexpr float emphasis_attenuation = 0.816f;
+
+uint8_t to_byte(float value) {
+  return (uint8_t)std::min(std::max(value * 255.0f + 0.5f, 0.0f), 255.0f);
+}
+
+}  // namespace
+
+Palette::Palette() {
+  set_default();
+}
+
+void Palette::set_default() {
+  uint8_t rgb[64][3];
+  for (int i = 0; i < 64; i++) {
+    rgb[i][0] = (default_palette[i] >> 16) & 0xFF;
+    rgb[i][1] = (default_palette[i] >> 8) & 0xFF;
+    rgb[i][2] = (default_palette[i] >> 0) & 0xFF;
+  }
+  set_colors(rgb, 64);
+}
+
+void Palette::generate(const PaletteModel& model) {
+  // Voltage levels of the PPU's square wave, relative to sync. Emphasis
+  // attenuates the wave during the phases of the emphasized colors.
+  constexpr float black = 0.518f;
+  constexpr float white = 1.962f;
+  constexpr float attenuation = 0.746f;
+  // Aligns the decoder with the color burst, so that e.g. color 6 is red
+  constexpr float burst_phase = 4.0f;
+  constexpr float levels[2][4] = {
+      {0.350f, 0.518f, 0.962f, 1.550f},  // low
+      {1.094f, 1.506f, 1.962f, 1.962f},  // high
+  };
+
+  for (int index = 0; index < size; index++) {
+    int color = index & 0x0F;
+    int level = (index >> 4) & 0x03;
+    int emphasis = index >> 6;
+    if (color > 13) {
+      level = 1;
+    }
+    float low = levels[0][level];
+    float high = levels[1][level];
+    if (color == 0) {
+      low = high;
+    } else if (color > 12) {
+      high = low;
+    }
+
+    // Decode 12 samples of one color subcarrier cycle as YIQ
+    float y = 0, i = 0, q = 0;
+    for (int phase = 0; phase < 12; phase++) {
+      auto in_phase = [phase](int c) { return (c + phase) % 12 < 6; };
+      float signal = in_phase(color) ? high : low;
+      if (((emphasis & 1) && in_phase(0)) || ((emphasis & 2) && in_phase(4)) ||
+          ((emphasis & 4) && in_phase(8))) {
+        signal *= attenuation;
+      }
+      signal = (signal - black) / (white - black);
+      float angle = (float)M_PI * (phase + burst_phase) / 6.0f +
+                    model.hue * (float)M_PI / 180.0f;
+      y += signal;
+      i += signal * std::cos(angle);
+      q += signal * std::sin(angle);
+    }
+    y = y / 12.0f * model.contrast + model.brightness;
+    i = i / 12.0f * model.saturation * model.contrast;
+    q = q / 12.0f * model.saturation * model.contrast;
+
+    float rgb[3] = {
+        y + 0.956f * i + 0.621f * q,
+        y - 0.272f * i - 0.647f * q,
+        y - 1.106f * i + 1.703f * q,
+    };
+    for (int c = 0; c < 3; c++) {
+      // The signal is gamma encoded for a CRT; adjust for the target display
+      float value = std::max(rgb[c], 0.0f);
+      lut[index][c] = to_byte(std::pow(value, 2.2f / model.gamma));
+    }
+    lut[index][3] = 0xFF;
+  }
+}
+
+bool Palette::load(const char* filename) {
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open palette %s\n", filename);
+    return false;
+  }
+  uint8_t rgb[size + 1][3];  // one extra to detect larger files
+  size_t count = fread(rgb, 3, size + 1, file);
+  fclose(file);
+  if (count != 64 && count != size) {
+    fprintf(stderr, "Palette %s should have 64 or 512 colors, not %zu\n",
+            filename, count);
+    return false;
+  }
+  set_colors(rgb, (int)count);
+  return true;
+}
+
+void Palette::set_colors(const uint8_t (*rgb)[3], int count) {
+  for (int index = 0; index < size; index++) {
+    if (count == size) {
+      for (int c = 0; c < 3; c++) {
+        lut[index][c] = rgb[index][c];
+      }
+    } else {
+      // Bits 6-8 emphasize red, green and blue
+      int emphasis = index >> 6;
+      for (int c = 0; c < 3; c++) {
+        float value = rgb[index & 0x3F][c];
+        if (emphasis != 0 && !(emphasis & (1 << c))) {
+          value *= emphasis_attenuation;
+        }
+        lut[index][c] = (uint8_t)value;
+      }
+    }
+    lut[index][3] = 0xFF;
+  }
+}
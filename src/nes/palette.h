@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+
+// Parameters of the NTSC signal model used by Palette::generate()
+struct PaletteModel {
+  float hue = 0.0f;  // degrees
+  float saturation = 1.0f;
+  float contrast = 1.0f;
+  float brightness = 0.0f;
+  float gamma = 2.2f;  // of the display the palette is tuned for
+};
+
+// Lookup table from a PPU output index to a color. The index is the 6 bit
+// palette color, with greyscale already applied, plus the 3 PPUMASK emphasis
+// bits above it, so the PPU never has to do any color math per pixel.
+class Palette {
+ public:
+  static constexpr int size = 512;
+  uint8_t lut[size][4];  // RGBA
+
+  Palette();
+  // The built-in 64 colors, with emphasis approximated by dimming the
+  // other channels
+  void set_default();
+  // Decodes the square wave the PPU outputs for each index as NTSC video
+  void generate(const PaletteModel& model = PaletteModel());
+  // Loads a .pal file of 64 (emphasis approximated) or 512 RGB colors
+  bool load(const char* filename);
+
+ private:
+  void set_colors(const uint8_t (*rgb)[3], int count);
+};
@@ -0,0 +1,27 @@
+#include "perf_counters.h"
+#include <cstdio>
+
+std::string PerfCounters::to_json() const {
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer),
+           "{\n"
+           "  \"frames\": %llu,\n"
+           "  \"instructions\": %llu,\n"
+           "  \"cycles\": %llu,\n"
+           "  \"ppu_register_writes\": %llu,\n"
+           "  \"bank_switches\": %llu,\n"
+           "  \"dma_stall_cycles\": %llu,\n"
+           "  \"irqs\": %llu,\n"
+           "  \"nmis\": %llu,\n"
+           "  \"run_frame_ms\": %.3f,\n"
+           "  \"update_texture_ms\": %.3f,\n"
+           "  \"audio_output_ms\": %.3f\n"
+           "}\n",
+           (unsigned long long)frames, (unsigned long long)instructions,
+           (unsigned long long)cycles, (unsigned long long)ppu_register_writes,
+           (unsigned long long)bank_switches,
+           (unsigned long long)dma_stall_cycles, (unsigned long long)irqs,
+           (unsigned long long)nmis, run_frame_ms, update_texture_ms,
+           audio_output_ms);
+  return buffer;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Cumulative counters for the emulator hot paths. They're only updated when
+// built with NES_PERF_COUNTERS, so the macros below compile to nothing
+// otherwise.
+struct PerfCounters {
+  uint64_t frames = 0;
+  uint64_t instructions = 0;
+  uint64_t cycles = 0;
+  uint64_t ppu_register_writes = 0;
+  uint64_t bank_switches = 0;
+  uint64_t dma_stall_cycles = 0;
+  uint64_t irqs = 0;
+  uint64_t nmis = 0;
+
+  // Milliseconds spent in each stage
+  double run_frame_ms = 0;
+  double update_texture_ms = 0;
+  double audio_output_ms = 0;
+
+  std::string to_json() const;
+};
+
+// Adds the elapsed time of its scope to a millisecond total
+class ScopedTimer {
+ public:
+  ScopedTimer(double& total_ms)
+      : total_ms(total_ms), start(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    total_ms += elapsed.count();
+  }
+
+ private:
+  double& total_ms;
+  std::chrono::steady_clock::time_point start;
+};
+
+#ifdef NES_PERF_COUNTERS
+#define PERF_COUNT(perf, counter, n) ((perf).counter += (n))
+#define PERF_TIMER(perf, timer) ScopedTimer perf_timer_##timer((perf).timer)
+#else
+#define PERF_COUNT(perf, counter, n)
+#define PERF_TIMER(perf, timer)
+#endif
@@ -1,4 +1,6 @@
 #include "ppu.h"
+#include <algorithm>
+#include <climits>
 #include <cstring>
 #include <stdexcept>
 #include "nes.h"
@@ -25,9 +27,45 @@ void PPU::power_on() {
   memset(CIRAM, 0x00, 0x800);
   memset(CGRAM, 0x00, 32);
   memset(OAM, 0x00, 256);
+  memset(at_shift_register, 0x00, sizeof(at_shift_register));
+  memset(at_latch, 0x00, sizeof(at_latch));
+  memset(pt_shift_register, 0x00, sizeof(pt_shift_register));
+  nt_byte = 0x00;
+  at_byte = 0x00;
+  memset(pt_byte, 0x00, sizeof(pt_byte));
+  memset(secondary_oam, 0xFF, sizeof(secondary_oam));
+  memset(rendering_oam, 0xFF, sizeof(rendering_oam));
   clear_pixels();
 }
 
+void PPU::visit_state(StateVisitor& v) {
+  v(frame_ready);
+  v(CIRAM);
+  v(CGRAM);
+  v(OAM);
+  v(vram_addr);
+  v(temp_vram_addr);
+  v(fine_x_scroll);
+  v(write_toggle);
+  v(bus_latch);
+  v(PPUCTRL);
+  v(PPUMASK);
+  v(PPUSTATUS);
+  v(OAMADDR);
+  v(data_buffer);
+  v(scanline);
+  v(scanline_cycle);
+  v(odd_frame);
+  v(at_shift_register);
+  v(at_latch);
+  v(pt_shift_register);
+  v(nt_byte);
+  v(at_byte);
+  v(pt_byte);
+  v(secondary_oam);
+  v(rendering_oam);
+}
+
 uint16_t PPU::nt_mirror_addr(uint16_t addr) {
   switch (nes.cartridge.get_mirror_mode()) {
     case MirrorMode::HORIZONTAL:
@@ -46,19 +84,6 @@ uint16_t PPU::nt_mirror_addr(uint16_t addr) {
 
 namespace {
 
-const uint32_t rgb_palette[64] = {
-    0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000,
-    0x881400, 0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000,
-    0x000000, 0x000000, 0xBCBCBC, 0x0078F8, 0x0058F8, 0x6844FC, 0xD800CC,
-    0xE40058, 0xF83800, 0xE45C10, 0xAC7C00, 0x00B800, 0x00A800, 0x00A844,
-    0x008888, 0x000000, 0x000000, 0x000000, 0xF8F8F8, 0x3CBCFC, 0x6888FC,
-    0x9878F8, 0xF878F8, 0xF85898, 0xF87858, 0xFCA044, 0xF8B800, 0xB8F818,
-    0x58D854, 0x58F898, 0x00E8D8, 0x787878, 0x000000, 0x000000, 0xFCFCFC,
-    0xA4E4FC, 0xB8B8F8, 0xD8B8F8, 0xF8B8F8, 0xF8A4C0, 0xF0D0B0, 0xFCE0A8,
-    0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000,
-    0x000000,
-};
-
 uint16_t palette_addr(uint16_t addr) {
   addr = addr & 0x001F;
   if ((addr & 0x13) == 0x10) {
@@ -110,6 +135,7 @@ uint8_t PPU::port_read(uint16_t addr) {
 }
 
 void PPU::port_write(uint16_t addr, uint8_t value) {
+  PERF_COUNT(nes.perf, ppu_register_writes, 1);
   bus_latch = value;
   switch (addr) {
     case 0x2000:
@@ -144,6 +170,15 @@ void PPU::write_PPUMASK(uint8_t value) {
   PPUMASK.raw = value;
 }
 
+void PPU::oam_dma(const uint8_t (&data)[256]) {
+  PERF_COUNT(nes.perf, ppu_register_writes, 256);
+  // OAMADDR wraps around back to where it started
+  int first = 256 - OAMADDR;
+  memcpy(&OAM[OAMADDR], data, first);
+  memcpy(OAM, data + first, OAMADDR);
+  bus_latch = data[255];
+}
+
 uint8_t PPU::read_PPUSTATUS() {
   write_toggle = false;
   uint8_t value = (bus_latch & 0x1F) | (PPUSTATUS.raw & 0xE0);
@@ -226,11 +261,134 @@ void PPU::tick() {
     if (scanline > 261) {
       scanline = 0;
       frame_ready = true;
+      if (output_enabled && resolve_enabled) {
+        resolve_pixels();
+      }
       odd_frame = !odd_frame;
     }
   }
 }
 
+void PPU::advance(int count) {
+  while (count > 0) {
+    int quiet = std::min(quiet_dots(), count);
+    if (quiet == 0) {
+      tick();
+      count--;
+      continue;
+    }
+    int dot = scanline * 341 + scanline_cycle + quiet;
+    scanline = dot / 341;
+    scanline_cycle = dot % 341;
+    count -= quiet;
+  }
+}
+
+int PPU::quiet_dots() {
+  constexpr int vblank_dot = 241 * 341 + 1;
+  constexpr int vblank_end_dot = 261 * 341 + 1;
+  constexpr int last_dot = 261 * 341 + 340;  // ends the frame
+  int dot = scanline * 341 + scanline_cycle;
+  if (rendering_enabled()) {
+    // Only vblank is quiet, apart from setting the flag
+    if (scanline < 240 || scanline > 260) {
+      return 0;
+    }
+    return dot <= vblank_dot ? vblank_dot - dot : 261 * 341 - dot;
+  }
+  if (dot <= vblank_dot) {
+    return vblank_dot - dot;
+  } else if (dot <= vblank_end_dot) {
+    return vblank_end_dot - dot;
+  }
+  return last_dot - dot;
+}
+
+int PPU::busy_dots() {
+  if (rendering_enabled() && scanline < 240) {
+    return 240 * 341 - (scanline * 341 + scanline_cycle);
+  }
+  return 0;
+}
+
+int PPU::idle_dots(bool irqs) {
+  constexpr int vblank_dot = 241 * 341 + 1;
+  constexpr int last_dot = 261 * 341 + 340;
+  int dot = scanline * 341 + scanline_cycle;
+  int dots = dot < vblank_dot ? vblank_dot - dot : last_dot - dot;
+  if (irqs && rendering_enabled()) {
+    // signal_scanline() happens at dot 260 of each rendered line
+    for (int line = scanline; line <= 261; line++) {
+      int signal_dot = line * 341 + 260;
+      if ((line <= 239 || line == 261) && signal_dot >= dot) {
+        dots = std::min(dots, signal_dot - dot);
+        break;
+      }
+    }
+  }
+  return dots;
+}
+
+int PPU::status_dots() {
+  constexpr int vblank_dot = 241 * 341 + 1;
+  constexpr int vblank_end_dot = 261 * 341 + 1;
+  int dot = scanline * 341 + scanline_cycle;
+  if (dot > vblank_end_dot) {
+    return INT_MAX;
+  }
+  int dots = (dot <= vblank_dot ? vblank_dot : vblank_end_dot) - dot;
+  if (scanline > 239 || !rendering_enabled()) {
+    return dots;
+  }
+
+  // Sprite 0 can only hit on the 8 dots it covers, on lines it's drawn on.
+  // Besides what OAM says, the line being drawn and the next one may still
+  // use sprites evaluated before OAM or PPUCTRL last changed.
+  bool hits = PPUSTATUS.sprite_0_hit == 0 && PPUMASK.show_bg &&
+              PPUMASK.show_sprites;
+  bool overflows = PPUSTATUS.sprite_overflow == 0;
+  int sprite_height = PPUCTRL.sprite_size ? 16 : 8;
+  int rendering_line = scanline_cycle > 257 ? scanline + 1 : scanline;
+  for (int line = scanline; line <= 239 && line * 341 < dot + dots; line++) {
+    int line_dot = line * 341;
+    if (hits) {
+      int xs[3];
+      int count = 0;
+      int y = OAM[0];
+      if (line >= y + 1 && line < y + 1 + sprite_height) {
+        xs[count++] = OAM[3];
+      }
+      if (line == rendering_line && rendering_oam[0].id == 0) {
+        xs[count++] = rendering_oam[0].x;
+      }
+      if (line == scanline + 1 && scanline_cycle > 64 &&
+          secondary_oam[0].id == 0) {
+        xs[count++] = secondary_oam[0].x;
+      }
+      for (int i = 0; i < count; i++) {
+        int start = line_dot + xs[i] + 1;
+        int end = line_dot + std::min(xs[i] + 8, 256);
+        if (dot <= end) {
+          dots = std::min(dots, std::max(start - dot, 0));
+        }
+      }
+    }
+    // Overflow is set when evaluating sprites for the next line
+    int evaluate_dot = line_dot + 64;
+    if (overflows && evaluate_dot >= dot && evaluate_dot - dot < dots) {
+      int n = 0;
+      for (int i = 0; i < 64; i++) {
+        int y = OAM[i * 4];
+        n += line >= y && line < y + sprite_height;
+      }
+      if (n > 8) {
+        dots = evaluate_dot - dot;
+      }
+    }
+  }
+  return dots;
+}
+
 bool PPU::rendering_enabled() {
   return PPUMASK.show_bg || PPUMASK.show_sprites;
 }
@@ -401,9 +559,28 @@ void PPU::load_rendering_oam() {
 
 void PPU::clear_pixels() {
   memset(pixels, 0x00, 240 * 256 * 3);
+  std::fill(&indices[0][0], &indices[0][0] + 240 * 256, 0x0F);
+}
+
+void PPU::resolve_pixels() {
+  const Palette& palette = nes.palette;
+  for (int y = 0; y < 240; y++) {
+    for (int x = 0; x < 256; x++) {
+      const uint8_t* rgb = palette.lut[indices[y][x]];
+      pixels[y][x][0] = rgb[0];
+      pixels[y][x][1] = rgb[1];
+      pixels[y][x][2] = rgb[2];
+    }
+  }
 }
 
 void PPU::render_pixel() {
+  // Hidden frames only need the pixel for sprite 0 hits, and sprite 0 is
+  // always the first of the line's sprites when it's there
+  if (!output_enabled &&
+      (PPUSTATUS.sprite_0_hit || rendering_oam[0].id != 0)) {
+    return;
+  }
   int x = scanline_cycle - 1;
   uint8_t palette = 0;
 
@@ -458,44 +635,16 @@ void PPU::render_pixel() {
     }
   }
 
-  uint8_t color = mem_read(0x3F00 | palette);
-  uint32_t rgb = rgb_palette[color];
-  pixels[scanline][x][0] = (rgb >> 16) & 0xFF;
-  pixels[scanline][x][1] = (rgb >> 8) & 0xFF;
-  pixels[scanline][x][2] = (rgb >> 0) & 0xFF;
-}
-
-void PPU::render_nametables(uint8_t (&out)[480][512][3]) {
-  for (int i = 0; i < 4; i++) {
-    uint16_t base_addr = 0x2000 + i * 0x0400;
-    int start_x = (i % 2) * 256;
-    int start_y = (i / 2) * 240;
-    for (int y = 0; y < 30; y++) {
-      for (int x = 0; x < 32; x++) {
-        uint8_t tile_index = nes.ppu.mem_read(base_addr + y * 32 + x);
-        uint16_t pt_addr = (PPUCTRL.bg_pt_addr << 12) | (tile_index << 4);
-        uint16_t at_addr = base_addr | 0x03C0 | ((y >> 2) << 3) | (x >> 2);
-        int at_shift = (x & 0x0002) | ((y & 0x0002) << 1);
-        uint8_t palette_index = (mem_read(at_addr) >> at_shift) & 0x03;
-        render_tile(pt_addr, palette_index, start_x + x * 8, start_y + y * 8,
-                    512, &out[0][0][0]);
-      }
-    }
+  if (!output_enabled) {
+    return;
   }
-}
-
-void PPU::render_pattern_tables(uint8_t (&out)[128][256][3]) {
-  for (int i = 0; i < 2; i++) {
-    int start_x = i * 128;
-    for (int y = 0; y < 16; y++) {
-      for (int x = 0; x < 16; x++) {
-        uint8_t tile_index = i * 256 + y * 16 + x;
-        uint16_t pt_addr = i * 0x1000 + (tile_index << 4);
-        render_tile(pt_addr, 0, start_x + x * 8, y * 8, 256, &out[0][0][0],
-                    true);
-      }
-    }
+  // Greyscale keeps only the brightness bits of the color, and the emphasis
+  // bits select one of the 8 palette variants
+  uint8_t color = mem_read(0x3F00 | palette) & 0x3F;
+  if (PPUMASK.greyscale) {
+    color &= 0x30;
   }
+  indices[scanline][x] = color | ((PPUMASK.raw & 0xE0) << 1);
 }
 
 void PPU::render_tile(uint16_t tile_addr,
@@ -518,18 +667,20 @@ void PPU::render_tile(uint16_t tile_addr,
       if (color_index != 0) {
         palette |= (palette_index << 2);
       }
-      uint32_t rgb = 0;
+      uint8_t rgb[3];
       if (greyscale) {
-        uint8_t c = color_index * 85;
-        rgb = c | (c << 8) | (c << 16);
+        rgb[0] = rgb[1] = rgb[2] = color_index * 85;
       } else {
-        uint8_t color = mem_read(0x3F00 | palette);
-        rgb = rgb_palette[color];
+        uint8_t color = mem_read(0x3F00 | palette) & 0x3F;
+        const uint8_t* entry = nes.palette.lut[color];
+        rgb[0] = entry[0];
+        rgb[1] = entry[1];
+        rgb[2] = entry[2];
       }
       int i = (start_y + y) * stride_x + start_x + x;
-      out[i * 3 + 0] = (rgb >> 16) & 0xFF;
-      out[i * 3 + 1] = (rgb >> 8) & 0xFF;
-      out[i * 3 + 2] = (rgb >> 0) & 0xFF;
+      out[i * 3 + 0] = rgb[0];
+      out[i * 3 + 1] = rgb[1];
+      out[i * 3 + 2] = rgb[2];
     }
   }
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include "bitfield.h"
+#include "state.h"
 
 struct OAMEntry {
   uint8_t id;
@@ -24,7 +25,11 @@ class NES;
 class PPU {
  public:
   uint8_t pixels[240][256][3];  // y, x, c
+  uint16_t indices[240][256];   // palette index, resolved to pixels per frame
   bool frame_ready = false;
+  bool output_enabled = true;  // false to skip writing pixels
+  // false to leave the frame in indices, for callers with their own palette
+  bool resolve_enabled = true;
 
   PPU(NES& nes);
   void power_on();
@@ -33,16 +38,38 @@ class PPU {
   void mem_write(uint16_t addr, uint8_t value);
   uint8_t port_read(uint16_t addr);
   void port_write(uint16_t addr, uint8_t value);
+  // Same as 256 writes to OAMDATA
+  void oam_dma(const uint8_t (&data)[256]);
 
   void tick();
+  // Same as count calls to tick(), but jumps over vblank, and the whole frame
+  // apart from the vblank flag changes while rendering is disabled
+  void advance(int count);
+  // Number of dots from here that tick() would only count through
+  int quiet_dots();
+  // Number of dots from here before quiet_dots() could be nonzero, unless
+  // rendering is toggled
+  int busy_dots();
   bool rendering_enabled();
+  int get_scanline() { return scanline; }
+  int get_scanline_cycle() { return scanline_cycle; }
   void clear_pixels();
+  // Converts indices to pixels through the palette
+  void resolve_pixels();
   void render_pixel();
   void render_scanline();
+  void visit_state(StateVisitor& v);
+  // Number of dots that can run before vblank starts, the frame ends or, if
+  // irqs is set, the mapper's scanline signal
+  int idle_dots(bool irqs);
+  // The flag bits of PPUSTATUS, without the side effects of reading it
+  uint8_t peek_status() { return PPUSTATUS.raw & 0xE0; }
+  // Number of dots before any of the PPUSTATUS flags could change, up to the
+  // end of the frame
+  int status_dots();
 
   // Debug rendering
-  void render_nametables(uint8_t (&out)[480][512][3]);
-  void render_pattern_tables(uint8_t (&out)[128][256][3]);
+  uint16_t get_bg_pattern_table() { return PPUCTRL.bg_pt_addr << 12; }
   void render_tile(uint16_t tile_addr,
                    uint8_t palette_index,
                    int start_x,
@@ -86,7 +113,6 @@ class PPU {
   } PPUCTRL;
   void write_PPUCTRL(uint8_t value);
 
-  // TODO: Handle greyscale and tints
   union {
     uint8_t raw;
     BitField8<0, 1> greyscale;
@@ -0,0 +1,113 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cmath>
+#include "nes.h"
+
+Profiler::Profiler(NES& nes) : nes(nes) {}
+
+void Profiler::reset() {
+  std::fill(std::begin(opcodes), std::end(opcodes), ProfileCounts());
+  addresses.assign(0x10000, ProfileCounts());
+  size_t rom_size =
+      nes.cartridge.mapper ? nes.cartridge.mapper->pgr_rom->size() : 0;
+  rom.assign(rom_size, ProfileCounts());
+  rom_PC.assign(rom_size, 0);
+}
+
+void Profiler::add(uint16_t PC, uint8_t opcode, int cycles) {
+  opcodes[opcode].executions++;
+  opcodes[opcode].cycles += cycles;
+  addresses[PC].executions++;
+  addresses[PC].cycles += cycles;
+  if (PC >= 0x8000) {
+    Mapper& mapper = *nes.cartridge.mapper;
+    size_t offset = mapper.pgr_map[(PC - 0x8000) / 0x2000] + PC % 0x2000;
+    if (offset < rom.size()) {
+      rom[offset].executions++;
+      rom[offset].cycles += cycles;
+      rom_PC[offset] = PC;
+    }
+  }
+}
+
+void Profiler::write_report(FILE* out, int max_entries) {
+  uint64_t total_cycles = 0;
+  for (int i = 0; i < 256; i++) {
+    total_cycles += opcodes[i].cycles;
+  }
+  if (total_cycles == 0) {
+    fprintf(out, "No instructions profiled\n");
+    return;
+  }
+
+  // Opcodes
+  std::vector<int> order;
+  for (int i = 0; i < 256; i++) {
+    if (opcodes[i].executions > 0) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [this](int a, int b) {
+    return opcodes[a].cycles > opcodes[b].cycles;
+  });
+  fprintf(out, "Opcodes by cycles:\n");
+  fprintf(out, "  op  name  %14s %14s  %6s\n", "executions", "cycles", "%");
+  for (int i = 0; i < (int)order.size() && i < max_entries; i++) {
+    const ProfileCounts& counts = opcodes[order[i]];
+    fprintf(out, "  %02X  %-4s  %14llu %14llu  %6.2f\n", order[i],
+            opcode_name(order[i]).c_str(),
+            (unsigned long long)counts.executions,
+            (unsigned long long)counts.cycles,
+            100.0 * counts.cycles / total_cycles);
+  }
+
+  // Locations: ROM code by (bank, PC), and anything below $8000 (RAM, SRAM)
+  // by address only
+  struct Location {
+    int bank;
+    uint16_t PC;
+    ProfileCounts counts;
+  };
+  std::vector<Location> locations;
+  for (size_t i = 0; i < rom.size(); i++) {
+    if (rom[i].executions > 0) {
+      locations.push_back({(int)(i / 0x2000), rom_PC[i], rom[i]});
+    }
+  }
+  for (int i = 0; i < 0x8000 && i < (int)addresses.size(); i++) {
+    if (addresses[i].executions > 0) {
+      locations.push_back({-1, (uint16_t)i, addresses[i]});
+    }
+  }
+  std::sort(locations.begin(), locations.end(),
+            [](const Location& a, const Location& b) {
+              return a.counts.cycles > b.counts.cycles;
+            });
+  fprintf(out, "\nHotspots by cycles:\n");
+  fprintf(out, "  bank  PC     op    %14s %14s  %6s\n", "executions", "cycles",
+          "%");
+  for (int i = 0; i < (int)locations.size() && i < max_entries; i++) {
+    const Location& location = locations[i];
+    char bank[16] = " --";
+    if (location.bank >= 0) {
+      snprintf(bank, sizeof(bank), "%3d", location.bank);
+    }
+    fprintf(out, "  %s   $%04X  %-4s  %14llu %14llu  %6.2f\n", bank,
+            location.PC, opcode_name(nes.cpu.peek(location.PC)).c_str(),
+            (unsigned long long)location.counts.executions,
+            (unsigned long long)location.counts.cycles,
+            100.0 * location.counts.cycles / total_cycles);
+  }
+}
+
+void Profiler::heatmap(uint8_t (&out)[0x10000]) {
+  uint64_t max_cycles = 0;
+  for (const ProfileCounts& counts : addresses) {
+    max_cycles = std::max(max_cycles, counts.cycles);
+  }
+  double scale = max_cycles > 0 ? 254.0 / std::log(max_cycles + 1.0) : 0;
+  for (int i = 0; i < 0x10000; i++) {
+    uint64_t cycles = i < (int)addresses.size() ? addresses[i].cycles : 0;
+    out[i] = cycles == 0 ? 0 : 1 + (uint8_t)(std::log(cycles + 1.0) * scale);
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+struct ProfileCounts {
+  uint64_t executions = 0;
+  uint64_t cycles = 0;
+};
+
+// Execution profile of the CPU by opcode and by address. Only updated when
+// built with NES_PROFILE; CPU::execute() has no profiling code otherwise.
+class NES;
+class Profiler {
+ public:
+  ProfileCounts opcodes[256];
+  std::vector<ProfileCounts> addresses;  // by CPU address, for the heatmap
+
+  Profiler(NES& nes);
+  // Clears the profile, and sizes it for the loaded cartridge
+  void reset();
+  void add(uint16_t PC, uint8_t opcode, int cycles);
+
+  // Sorted report of the hottest opcodes and (PRG bank, PC) locations
+  void write_report(FILE* out, int max_entries = 50);
+  // Log-scaled cycles per CPU address, 0 (never executed) to 255 (hottest)
+  void heatmap(uint8_t (&out)[0x10000]);
+
+ private:
+  NES& nes;
+  // By PRG ROM offset, which separates code in different banks that runs at
+  // the same CPU address
+  std::vector<ProfileCounts> rom;
+  std::vector<uint16_t> rom_PC;  // CPU address the offset was last run at
+};
@@ -0,0 +1,140 @@
+#include "resampler.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define RESAMPLER_SSE
+#endif
+
+namespace {
+
+constexpr int zero_crossings = 8;  // each side of the kernel
+constexpr double max_cutoff = 20000.0;
+
+// Windowed sinc low-pass, cutoff in cycles per input sample
+double lowpass(double x, double cutoff, double half_width) {
+  double u = x / half_width;
+  if (std::abs(u) >= 1.0) {
+    return 0.0;
+  }
+  double blackman = 0.42 + 0.5 * cos(M_PI * u) + 0.08 * cos(2 * M_PI * u);
+  double t = 2 * cutoff * x;
+  double sinc = t == 0.0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+  return 2 * cutoff * sinc * blackman;
+}
+
+// Dot products of one kernel row with both channels
+void dot2(const float* kernel,
+          const float* left,
+          const float* right,
+          int taps,
+          float& out_left,
+          float& out_right) {
+#ifdef RESAMPLER_SSE
+  __m128 sum_l = _mm_setzero_ps();
+  __m128 sum_r = _mm_setzero_ps();
+  for (int i = 0; i < taps; i += 4) {
+    __m128 k = _mm_loadu_ps(kernel + i);
+    sum_l = _mm_add_ps(sum_l, _mm_mul_ps(k, _mm_loadu_ps(left + i)));
+    sum_r = _mm_add_ps(sum_r, _mm_mul_ps(k, _mm_loadu_ps(right + i)));
+  }
+  // Horizontal sums, left in the low half and right in the high half
+  __m128 lr = _mm_add_ps(_mm_unpacklo_ps(sum_l, sum_r),
+                         _mm_unpackhi_ps(sum_l, sum_r));
+  lr = _mm_add_ps(lr, _mm_movehl_ps(lr, lr));
+  out_left = _mm_cvtss_f32(lr);
+  out_right = _mm_cvtss_f32(_mm_shuffle_ps(lr, lr, 1));
+#else
+  float sum_l[4] = {0};
+  float sum_r[4] = {0};
+  for (int i = 0; i < taps; i += 4) {
+    for (int j = 0; j < 4; j++) {
+      sum_l[j] += kernel[i + j] * left[i + j];
+      sum_r[j] += kernel[i + j] * right[i + j];
+    }
+  }
+  out_left = (sum_l[0] + sum_l[1]) + (sum_l[2] + sum_l[3]);
+  out_right = (sum_r[0] + sum_r[1]) + (sum_r[2] + sum_r[3]);
+#endif
+}
+
+int16_t to_int16(float value) {
+  return (int16_t)std::min(std::max(value, (float)INT16_MIN), (float)INT16_MAX);
+}
+
+}  // namespace
+
+void Resampler::configure(double input_rate, int output_rate) {
+  output_rate = std::min(std::max(output_rate, 8000), max_output_rate);
+  this->input_rate = input_rate;
+  step = input_rate / output_rate;
+  position = 0;
+
+  double cutoff = std::min(0.45 * output_rate, max_cutoff) / input_rate;
+  double half_width = zero_crossings / (2 * cutoff);
+  taps = ((int)ceil(2 * half_width) + 3) & ~3;
+
+  // Row j is the kernel for an output j / phases of an input sample past the
+  // start of its window
+  double center = taps / 2 - 1;
+  kernel.resize((phases + 1) * taps);
+  for (int j = 0; j <= phases; j++) {
+    float* row = &kernel[j * taps];
+    double sum = 0;
+    for (int k = 0; k < taps; k++) {
+      row[k] = lowpass(k - center - (double)j / phases, cutoff, taps / 2.0);
+      sum += row[k];
+    }
+    // Normalize each phase to unity gain at DC
+    for (int k = 0; k < taps; k++) {
+      row[k] /= sum;
+    }
+  }
+
+  for (int c = 0; c < 2; c++) {
+    history[c].clear();
+  }
+}
+
+void Resampler::set_output_rate(double rate) {
+  if (taps > 0) {
+    step = input_rate / rate;
+  }
+}
+
+void Resampler::process(const float* left,
+                        const float* right,
+                        int count,
+                        float gain,
+                        std::vector<int16_t>& out) {
+  if (taps == 0) {
+    return;
+  }
+  history[0].insert(history[0].end(), left, left + count);
+  history[1].insert(history[1].end(), right, right + count);
+
+  int size = history[0].size();
+  while ((int)position + taps <= size) {
+    int start = (int)position;
+    float phase = (float)(position - start) * phases;
+    int j = std::min((int)phase, phases - 1);
+    float t = phase - j;
+
+    const float* row = &kernel[j * taps];
+    float l0, r0, l1, r1;
+    dot2(row, &history[0][start], &history[1][start], taps, l0, r0);
+    dot2(row + taps, &history[0][start], &history[1][start], taps, l1, r1);
+    out.push_back(to_int16((l0 + (l1 - l0) * t) * gain));
+    out.push_back(to_int16((r0 + (r1 - r0) * t) * gain));
+    position += step;
+  }
+
+  // Drop the input no future output can reach
+  int consumed = std::min((int)position, size);
+  for (int c = 0; c < 2; c++) {
+    history[c].erase(history[c].begin(), history[c].begin() + consumed);
+  }
+  position -= consumed;
+}
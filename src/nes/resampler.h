@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Streaming stereo polyphase FIR resampler. Filters out everything above the
+// audible range of the output rate and decimates, carrying its history across
+// calls so output is continuous between frames.
+class Resampler {
+ public:
+  static constexpr int max_output_rate = 96000;
+
+  // Rebuilds the filter for a new nominal output rate and drops any history
+  void configure(double input_rate, int output_rate);
+  // Fine-tunes the rate without rebuilding the filter, e.g. to track the
+  // audio device's queue
+  void set_output_rate(double rate);
+  // Appends interleaved stereo samples to out, scaled by gain
+  void process(const float* left,
+               const float* right,
+               int count,
+               float gain,
+               std::vector<int16_t>& out);
+
+ private:
+  static constexpr int phases = 64;
+
+  double input_rate = 0;
+  double step = 1;      // input samples per output sample
+  double position = 0;  // of the next output sample in the history
+  int taps = 0;         // per phase, a multiple of 4
+  // (phases + 1) rows of taps, so each output can interpolate between the
+  // two phases around it
+  std::vector<float> kernel;
+  std::vector<float> history[2];
+};
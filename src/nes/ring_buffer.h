@@ -0,0 +1,64 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Lock-free single producer, single consumer ring buffer. One thread may call
+// push() while another calls pop(); size() is safe from either.
+template <typename T>
+class RingBuffer {
+ public:
+  // Capacity is rounded up to a power of two
+  RingBuffer(size_t min_capacity = 1024) {
+    size_t capacity = 1;
+    while (capacity < min_capacity) {
+      capacity <<= 1;
+    }
+    buffer.resize(capacity);
+    mask = capacity - 1;
+  }
+
+  size_t capacity() const { return buffer.size(); }
+
+  size_t size() const {
+    return write_index.load(std::memory_order_acquire) -
+           read_index.load(std::memory_order_acquire);
+  }
+
+  // Returns the number of items pushed, which is less than count if full
+  size_t push(const T* data, size_t count) {
+    size_t write = write_index.load(std::memory_order_relaxed);
+    size_t read = read_index.load(std::memory_order_acquire);
+    size_t n = std::min(count, buffer.size() - (write - read));
+    for (size_t i = 0; i < n; i++) {
+      buffer[(write + i) & mask] = data[i];
+    }
+    write_index.store(write + n, std::memory_order_release);
+    return n;
+  }
+
+  // Returns the number of items popped, which is less than count if empty
+  size_t pop(T* out, size_t count) {
+    size_t read = read_index.load(std::memory_order_relaxed);
+    size_t write = write_index.load(std::memory_order_acquire);
+    size_t n = std::min(count, write - read);
+    for (size_t i = 0; i < n; i++) {
+      out[i] = buffer[(read + i) & mask];
+    }
+    read_index.store(read + n, std::memory_order_release);
+    return n;
+  }
+
+  // Only safe while neither side is in use
+  void clear() {
+    read_index.store(0, std::memory_order_relaxed);
+    write_index.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+  std::vector<T> buffer;
+  size_t mask;
+  std::atomic<size_t> read_index{0};
+  std::atomic<size_t> write_index{0};
+};
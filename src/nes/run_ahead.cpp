@@ -0,0 +1,75 @@
+#include "run_ahead.h"
+#include <algorithm>
+#include "nes.h"
+
+namespace {
+
+void update_average(double& average, double value) {
+  constexpr double alpha = 0.05;
+  average = average == 0 ? value : value * alpha + average * (1.0 - alpha);
+}
+
+}  // namespace
+
+RunAhead::RunAhead(NES& nes) : nes(nes) {}
+
+void RunAhead::run_frame() {
+  if (auto_frames) {
+    frames = frames_for_budget(budget_ms);
+  }
+  frames = std::min(std::max(frames, 0), max_frames);
+  if (frames == 0 || !nes.loaded) {
+    run_timed(true, true);
+    return;
+  }
+
+  // The real frame; its video is never shown
+  run_timed(false, true);
+  Joypad::Polls polls = nes.joypad.polls;
+
+  double ms = 0;
+  {
+    ScopedTimer timer(ms);
+    nes.save_state(snapshot);
+  }
+  for (int i = 1; i <= frames; i++) {
+    run_timed(i == frames, false);
+  }
+  {
+    ScopedTimer timer(ms);
+    nes.load_state(snapshot);
+  }
+  // Report the input polling of the real frame, not the last hidden one
+  nes.joypad.polls = polls;
+  update_average(snapshot_ms, ms);
+}
+
+double RunAhead::cost_ms(int n) const {
+  if (n == 0) {
+    return frame_ms;
+  }
+  // Before any hidden frames have run, assume they cost as much as a full one
+  double hidden_ms = hidden_frame_ms > 0 ? hidden_frame_ms : frame_ms;
+  return frame_ms * 2 + hidden_ms * (n - 1) + snapshot_ms;
+}
+
+int RunAhead::frames_for_budget(double budget_ms) const {
+  int n = max_frames;
+  while (n > 0 && cost_ms(n) > budget_ms) {
+    n--;
+  }
+  return n;
+}
+
+void RunAhead::run_timed(bool video, bool audio) {
+  nes.ppu.output_enabled = video;
+  nes.apu.output_enabled = audio;
+  double ms = 0;
+  {
+    ScopedTimer timer(ms);
+    nes.run_frame();
+  }
+  update_average(video || audio ? frame_ms : hidden_frame_ms, ms);
+  nes.ppu.output_enabled = true;
+  nes.apu.output_enabled = true;
+}
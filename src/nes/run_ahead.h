@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Hides input lag by presenting the frame that is N frames ahead of the real
+// emulation. Each host frame runs one real frame (with audio), saves the
+// state, runs N more frames with the current input and output suppressed
+// (except the video of the last one), then restores the saved state.
+class NES;
+class RunAhead {
+ public:
+  static constexpr int max_frames = 4;
+  int frames = 0;  // N, or 0 to disable
+  // Pick N each frame as the largest that fits in budget_ms
+  bool auto_frames = false;
+  double budget_ms = 8.0;
+
+  // Moving averages of the cost of each step, in milliseconds
+  double frame_ms = 0;         // a frame with video or audio output
+  double hidden_frame_ms = 0;  // a frame with all output suppressed
+  double snapshot_ms = 0;      // saving and restoring the state
+
+  RunAhead(NES& nes);
+  void run_frame();
+  // Estimated cost of a host frame with n frames of run-ahead
+  double cost_ms(int n) const;
+  // Largest n with cost_ms(n) <= budget_ms
+  int frames_for_budget(double budget_ms) const;
+
+ private:
+  NES& nes;
+  std::vector<uint8_t> snapshot;
+
+  void run_timed(bool video, bool audio);
+};
@@ -0,0 +1,159 @@
+#include "state.h"
+#include <cstring>
+
+namespace {
+
+constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint32_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * prime2;
+  acc = rotl(acc, 31);
+  return acc * prime1;
+}
+
+uint64_t merge_round(uint64_t acc, uint64_t lane) {
+  acc ^= xxh_round(0, lane);
+  return acc * prime1 + prime4;
+}
+
+}  // namespace
+
+StateHasher::StateHasher(uint64_t seed) : seed(seed) {
+  lanes[0] = seed + prime1 + prime2;
+  lanes[1] = seed + prime2;
+  lanes[2] = seed;
+  lanes[3] = seed - prime1;
+}
+
+void StateHasher::visit(void* data, size_t size) {
+  update(data, size);
+}
+
+void StateHasher::update(const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  total_size += size;
+
+  if (buffer_size + size < 32) {
+    memcpy(buffer + buffer_size, p, size);
+    buffer_size += size;
+    return;
+  }
+  if (buffer_size > 0) {
+    size_t fill = 32 - buffer_size;
+    memcpy(buffer + buffer_size, p, fill);
+    for (int i = 0; i < 4; i++) {
+      lanes[i] = xxh_round(lanes[i], read64(buffer + i * 8));
+    }
+    p += fill;
+    size -= fill;
+    buffer_size = 0;
+  }
+
+  // The four lanes are independent, so this loop pipelines well and is the
+  // only part that matters for the large blocks (RAM, CIRAM, ...)
+  const uint8_t* end = p + size;
+  while (end - p >= 32) {
+    lanes[0] = xxh_round(lanes[0], read64(p + 0));
+    lanes[1] = xxh_round(lanes[1], read64(p + 8));
+    lanes[2] = xxh_round(lanes[2], read64(p + 16));
+    lanes[3] = xxh_round(lanes[3], read64(p + 24));
+    p += 32;
+  }
+  buffer_size = end - p;
+  memcpy(buffer, p, buffer_size);
+}
+
+uint64_t StateHasher::digest() const {
+  uint64_t h;
+  if (total_size >= 32) {
+    h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) +
+        rotl(lanes[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h = merge_round(h, lanes[i]);
+    }
+  } else {
+    h = seed + prime5;
+  }
+  h += total_size;
+
+  const uint8_t* p = buffer;
+  size_t size = buffer_size;
+  while (size >= 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl(h, 27) * prime1 + prime4;
+    p += 8;
+    size -= 8;
+  }
+  if (size >= 4) {
+    h ^= read32(p) * prime1;
+    h = rotl(h, 23) * prime2 + prime3;
+    p += 4;
+    size -= 4;
+  }
+  while (size > 0) {
+    h ^= (*p) * prime5;
+    h = rotl(h, 11) * prime1;
+    p++;
+    size--;
+  }
+
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+StateHasher128::StateHasher128()
+    : hashers{StateHasher(0), StateHasher(0x9E3779B97F4A7C15ull)} {}
+
+void StateHasher128::visit(void* data, size_t size) {
+  hashers[0].update(data, size);
+  hashers[1].update(data, size);
+}
+
+void StateHasher128::digest(uint64_t (&out)[2]) const {
+  out[0] = hashers[0].digest();
+  out[1] = hashers[1].digest();
+}
+
+StateWriter::StateWriter(std::vector<uint8_t>& out) : out(out) {
+  out.clear();
+}
+
+void StateWriter::visit(void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  out.insert(out.end(), p, p + size);
+}
+
+StateReader::StateReader(const std::vector<uint8_t>& in) : in(in) {}
+
+void StateReader::visit(void* data, size_t size) {
+  if (failed || offset + size > in.size()) {
+    failed = true;
+    return;
+  }
+  memcpy(data, in.data() + offset, size);
+  offset += size;
+}
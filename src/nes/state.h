@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Walks over the mutable emulator state. Each component lists its state once
+// in visit_state(), and the visitor decides what to do with the bytes.
+class StateVisitor {
+ public:
+  virtual ~StateVisitor() = default;
+  virtual void visit(void* data, size_t size) = 0;
+
+  template <typename T>
+  void operator()(T& value) {
+    visit(&value, sizeof(T));
+  }
+};
+
+// Streaming 64-bit xxHash (XXH64) of the visited state
+class StateHasher : public StateVisitor {
+ public:
+  StateHasher(uint64_t seed = 0);
+  void visit(void* data, size_t size) override;
+  void update(const void* data, size_t size);
+  uint64_t digest() const;
+
+ private:
+  uint64_t seed;
+  uint64_t lanes[4];
+  uint8_t buffer[32];
+  size_t buffer_size = 0;
+  uint64_t total_size = 0;
+};
+
+// 128-bit hash of the visited state, from two XXH64 streams with different
+// seeds, for keys where a 64-bit collision would go unnoticed
+class StateHasher128 : public StateVisitor {
+ public:
+  StateHasher128();
+  void visit(void* data, size_t size) override;
+  void digest(uint64_t (&out)[2]) const;
+
+ private:
+  StateHasher hashers[2];
+};
+
+// Copies the visited state into a snapshot. The buffer keeps its capacity
+// between snapshots, so repeated saves don't allocate.
+class StateWriter : public StateVisitor {
+ public:
+  StateWriter(std::vector<uint8_t>& out);
+  void visit(void* data, size_t size) override;
+
+ private:
+  std::vector<uint8_t>& out;
+};
+
+// Copies a snapshot made by StateWriter back into the visited state
+class StateReader : public StateVisitor {
+ public:
+  StateReader(const std::vector<uint8_t>& in);
+  void visit(void* data, size_t size) override;
+  // False if the snapshot didn't match the layout of the visited state
+  bool ok() const { return !failed && offset == in.size(); }
+
+ private:
+  const std::vector<uint8_t>& in;
+  size_t offset = 0;
+  bool failed = false;
+};
\ No newline at end of file
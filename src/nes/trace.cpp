@@ -0,0 +1,160 @@
+#include "trace.h"
+#include <cstring>
+
+namespace {
+
+constexpr char file_magic[8] = {'N', 'E', 'S', 'T', 'R', 'A', 'C', 'E'};
+
+struct OpcodeInfo {
+  const char* name;
+  const char* mode;
+};
+
+const OpcodeInfo opcode_info[256] = {
+#define X(opcode, op, mode) {#op, #mode},
+#include "instructions.h"
+#undef X
+};
+
+int instruction_length(const char* mode) {
+  if (strcmp(mode, "imp") == 0 || strcmp(mode, "acc") == 0) {
+    return 1;
+  } else if (strncmp(mode, "abs", 3) == 0 || strcmp(mode, "ind") == 0) {
+    return 3;
+  }
+  return 2;
+}
+
+std::string format_operand(const TraceRecord& record, const char* mode) {
+  char buffer[16];
+  uint8_t lo = record.opcode[1];
+  uint16_t addr = lo | (record.opcode[2] << 8);
+  if (strcmp(mode, "acc") == 0) {
+    return "A";
+  } else if (strcmp(mode, "imm") == 0) {
+    snprintf(buffer, sizeof(buffer), "#$%02X", lo);
+  } else if (strcmp(mode, "zp") == 0) {
+    snprintf(buffer, sizeof(buffer), "$%02X", lo);
+  } else if (strcmp(mode, "zp_x") == 0) {
+    snprintf(buffer, sizeof(buffer), "$%02X,X", lo);
+  } else if (strcmp(mode, "zp_y") == 0) {
+    snprintf(buffer, sizeof(buffer), "$%02X,Y", lo);
+  } else if (strcmp(mode, "rel") == 0) {
+    snprintf(buffer, sizeof(buffer), "$%04X",
+             (uint16_t)(record.PC + 2 + (int8_t)lo));
+  } else if (strcmp(mode, "abs") == 0) {
+    snprintf(buffer, sizeof(buffer), "$%04X", addr);
+  } else if (strncmp(mode, "abs_x", 5) == 0) {
+    snprintf(buffer, sizeof(buffer), "$%04X,X", addr);
+  } else if (strncmp(mode, "abs_y", 5) == 0) {
+    snprintf(buffer, sizeof(buffer), "$%04X,Y", addr);
+  } else if (strcmp(mode, "ind") == 0) {
+    snprintf(buffer, sizeof(buffer), "($%04X)", addr);
+  } else if (strcmp(mode, "ind_x") == 0) {
+    snprintf(buffer, sizeof(buffer), "($%02X,X)", lo);
+  } else if (strncmp(mode, "ind_y", 5) == 0) {
+    snprintf(buffer, sizeof(buffer), "($%02X),Y", lo);
+  } else {
+    return "";
+  }
+  return buffer;
+}
+
+}  // namespace
+
+std::string opcode_name(uint8_t opcode) {
+  // Strip the _A suffix of the accumulator variants (e.g. ASL_A)
+  const char* name = opcode_info[opcode].name;
+  std::string mnemonic(name, strcspn(name, "_"));
+  return mnemonic == "UNIMPL" ? "???" : mnemonic;
+}
+
+std::string format_trace_record(const TraceRecord& record) {
+  const OpcodeInfo& info = opcode_info[record.opcode[0]];
+  int length = instruction_length(info.mode);
+
+  char bytes[16] = "";
+  int offset = 0;
+  for (int i = 0; i < length; i++) {
+    offset += snprintf(bytes + offset, sizeof(bytes) - offset,
+                       i == 0 ? "%02X" : " %02X", record.opcode[i]);
+  }
+
+  std::string disassembly = opcode_name(record.opcode[0]);
+  std::string operand = format_operand(record, info.mode);
+  if (!operand.empty()) {
+    disassembly += " " + operand;
+  }
+
+  char line[128];
+  snprintf(line, sizeof(line),
+           "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d "
+           "CYC:%u",
+           record.PC, bytes, disassembly.c_str(), record.A, record.X, record.Y,
+           record.P, record.SP, record.scanline, record.scanline_cycle,
+           record.cycles);
+  return line;
+}
+
+void TraceRecorder::start(int capacity_log2) {
+  records.assign((size_t)1 << capacity_log2, TraceRecord());
+  mask = records.size() - 1;
+  count.store(0, std::memory_order_release);
+}
+
+void TraceRecorder::stop() {
+  records.clear();
+  records.shrink_to_fit();
+  mask = 0;
+  count.store(0, std::memory_order_release);
+}
+
+uint64_t TraceRecorder::size() const {
+  uint64_t n = count.load(std::memory_order_acquire);
+  return n < records.size() ? n : records.size();
+}
+
+bool TraceRecorder::save(const char* filename) const {
+  FILE* file = fopen(filename, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s for writing\n", filename);
+    return false;
+  }
+  // Write the oldest record first
+  uint64_t n = count.load(std::memory_order_acquire);
+  uint64_t num_records = size();
+  fwrite(file_magic, sizeof(file_magic), 1, file);
+  fwrite(&num_records, sizeof(num_records), 1, file);
+  for (uint64_t i = n - num_records; i < n; i++) {
+    fwrite(&records[i & mask], sizeof(TraceRecord), 1, file);
+  }
+  fclose(file);
+  return true;
+}
+
+bool TraceRecorder::decode(const char* filename, FILE* out) {
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open trace file %s\n", filename);
+    return false;
+  }
+  char magic[sizeof(file_magic)];
+  uint64_t num_records = 0;
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, file_magic, sizeof(magic)) != 0 ||
+      fread(&num_records, sizeof(num_records), 1, file) != 1) {
+    fprintf(stderr, "Invalid trace file %s\n", filename);
+    fclose(file);
+    return false;
+  }
+  TraceRecord record;
+  for (uint64_t i = 0; i < num_records; i++) {
+    if (fread(&record, sizeof(record), 1, file) != 1) {
+      fprintf(stderr, "Trace file %s is truncated\n", filename);
+      break;
+    }
+    fprintf(out, "%s\n", format_trace_record(record).c_str());
+  }
+  fclose(file);
+  return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Fixed-size snapshot of the CPU taken before an instruction executes
+struct TraceRecord {
+  uint32_t cycles;
+  uint16_t PC;
+  uint16_t scanline;
+  uint16_t scanline_cycle;
+  uint8_t opcode[3];  // opcode and up to two operand bytes
+  uint8_t A;
+  uint8_t X;
+  uint8_t Y;
+  uint8_t P;
+  uint8_t SP;
+  uint8_t reserved[2];
+};
+static_assert(sizeof(TraceRecord) == 20, "TraceRecord should be packed");
+
+// Mnemonic of an opcode, e.g. "LDA"
+std::string opcode_name(uint8_t opcode);
+
+// Formats a record as a line in the nestest.log format (without the trailing
+// newline). Memory values after the operand aren't recorded, so unlike
+// nestest.log the disassembly doesn't include them.
+std::string format_trace_record(const TraceRecord& record);
+
+// Ring buffer of the most recent trace records. Only the emulation thread
+// writes, and add() keeps overwriting the oldest records, so only read it
+// (size(), save()) while the emulation thread is stopped.
+class TraceRecorder {
+ public:
+  void start(int capacity_log2);
+  void stop();
+  bool enabled() const { return !records.empty(); }
+
+  void add(const TraceRecord& record) {
+    uint64_t n = count.load(std::memory_order_relaxed);
+    records[n & mask] = record;
+    count.store(n + 1, std::memory_order_release);
+  }
+
+  uint64_t size() const;
+  bool save(const char* filename) const;
+  static bool decode(const char* filename, FILE* out);
+
+ private:
+  std::vector<TraceRecord> records;
+  uint64_t mask = 0;
+  std::atomic<uint64_t> count{0};
+};
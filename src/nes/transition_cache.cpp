@@ -0,0 +1,93 @@
+#include "transition_cache.h"
+#include <algorithm>
+
+TransitionCache::TransitionCache(size_t max_bytes, int num_shards)
+    : num_shards(std::max(num_shards, 1)) {
+  shards = std::make_unique<Shard[]>(this->num_shards);
+  max_shard_bytes = max_bytes / this->num_shards;
+}
+
+bool TransitionCache::run_frame(NES& nes) {
+  Key key;
+  StateHasher128 hasher;
+  nes.visit_state(hasher);
+  hasher.digest(key.hash);
+  // The buttons are host input rather than state, so they're keyed on their
+  // own
+  key.buttons = nes.joypad.get_buttons(0) | nes.joypad.get_buttons(1) << 8;
+
+  Shard& shard = shards[key.hash[1] % num_shards];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.hits++;
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+      const Entry& entry = *it->second;
+      nes.load_state(entry.state);
+      nes.joypad.polls = entry.polls;
+      return true;
+    }
+    shard.misses++;
+  }
+
+  nes.run_frame();
+  Entry entry;
+  entry.key = key;
+  nes.save_state(entry.state);
+  entry.state.shrink_to_fit();  // drop the slack from growing it
+  entry.polls = nes.joypad.polls;
+  insert(shard, std::move(entry));
+  return false;
+}
+
+TransitionCache::Stats TransitionCache::stats() const {
+  Stats stats;
+  for (int i = 0; i < num_shards; i++) {
+    Shard& shard = shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.hits += shard.hits;
+    stats.misses += shard.misses;
+    stats.evictions += shard.evictions;
+    stats.entries += shard.index.size();
+    stats.bytes += shard.bytes;
+  }
+  return stats;
+}
+
+void TransitionCache::clear() {
+  for (int i = 0; i < num_shards; i++) {
+    Shard& shard = shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.index.clear();
+    shard.entries.clear();
+    shard.bytes = 0;
+  }
+}
+
+size_t TransitionCache::entry_bytes(const Entry& entry) {
+  // Plus a rough allowance for the list and index nodes
+  return sizeof(Entry) + entry.state.capacity() + 64;
+}
+
+void TransitionCache::insert(Shard& shard, Entry&& entry) {
+  size_t bytes = entry_bytes(entry);
+  if (bytes > max_shard_bytes) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.index.count(entry.key)) {
+    // Another thread ran the same frame first
+    return;
+  }
+  while (shard.bytes + bytes > max_shard_bytes) {
+    const Entry& oldest = shard.entries.back();
+    shard.bytes -= entry_bytes(oldest);
+    shard.index.erase(oldest.key);
+    shard.entries.pop_back();
+    shard.evictions++;
+  }
+  shard.entries.push_front(std::move(entry));
+  shard.index[shard.entries.front().key] = shard.entries.begin();
+  shard.bytes += bytes;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "nes.h"
+
+// Remembers the state each frame led to, keyed by a 128-bit hash of the state
+// before it plus the joypad buttons, so search branches that reconverge don't
+// emulate the same frame twice. Memory is bounded, evicting the least
+// recently used entries. Safe to share between threads: entries are split
+// over shards, each with its own lock.
+//
+// A hit restores the state and Joypad::polls, but doesn't draw the frame or
+// produce audio. NESes using it must not have a Joypad::input_provider.
+class TransitionCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    double hit_rate() const {
+      return hits + misses ? (double)hits / (hits + misses) : 0.0;
+    }
+  };
+
+  explicit TransitionCache(size_t max_bytes, int num_shards = 16);
+  // Same as nes.run_frame() with the buttons already set, unless the result
+  // is cached. Returns true on a hit.
+  bool run_frame(NES& nes);
+  Stats stats() const;
+  void clear();
+
+ private:
+  struct Key {
+    uint64_t hash[2];
+    uint16_t buttons;
+    bool operator==(const Key& other) const {
+      return hash[0] == other.hash[0] && hash[1] == other.hash[1] &&
+             buttons == other.buttons;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return (size_t)(key.hash[0] ^ key.buttons);
+    }
+  };
+  struct Entry {
+    Key key;
+    std::vector<uint8_t> state;
+    Joypad::Polls polls;
+  };
+  // Most recently used first
+  using EntryList = std::list<Entry>;
+  struct Shard {
+    std::mutex mutex;
+    EntryList entries;
+    std::unordered_map<Key, EntryList::iterator, KeyHash> index;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  std::unique_ptr<Shard[]> shards;
+  int num_shards;
+  size_t max_shard_bytes;
+
+  static size_t entry_bytes(const Entry& entry);
+  void insert(Shard& shard, Entry&& entry);
+};
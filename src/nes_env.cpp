@@ -0,0 +1,71 @@
+#include "nes_env.h"
+#include "vec_env.h"
+
+struct NesEnv {
+  VecEnv env;
+  explicit NesEnv(const NesEnvConfig& config) : env(config) {}
+};
+
+void nes_env_default_config(NesEnvConfig* config) {
+  config->num_envs = 1;
+  config->num_threads = 0;
+  config->observation = NES_ENV_OBS_PIXELS;
+  config->frameskip = 4;
+  config->max_pool = 1;
+  config->noop_max = 30;
+  config->max_episode_steps = 0;
+  config->reward_address = -1;
+  config->reward_bytes = 1;
+  config->done_address = -1;
+  config->done_value = 0;
+  config->obs_width = 84;
+  config->obs_height = 84;
+  config->crop_top = 0;
+  config->crop_bottom = 0;
+  config->crop_left = 0;
+  config->crop_right = 0;
+  config->frame_stack = 1;
+  config->cache_mb = 0;
+}
+
+NesEnv* nes_env_create(const char* rom, const NesEnvConfig* config) {
+  NesEnv* env = new NesEnv(*config);
+  if (!env->env.load(rom)) {
+    delete env;
+    return nullptr;
+  }
+  return env;
+}
+
+void nes_env_destroy(NesEnv* env) {
+  delete env;
+}
+
+int nes_env_num_envs(const NesEnv* env) {
+  return env->env.num_envs();
+}
+
+size_t nes_env_observation_size(const NesEnv* env) {
+  return env->env.observation_size();
+}
+
+void nes_env_reset(NesEnv* env, const uint64_t* seeds, uint8_t* observations) {
+  env->env.reset(seeds, observations);
+}
+
+void nes_env_step(NesEnv* env,
+                  const uint8_t* actions,
+                  uint8_t* observations,
+                  float* rewards,
+                  uint8_t* dones) {
+  env->env.step(actions, observations, rewards, dones);
+}
+
+void nes_env_cache_stats(const NesEnv* env, NesEnvCacheStats* stats) {
+  TransitionCache::Stats cache = env->env.cache_stats();
+  stats->hits = cache.hits;
+  stats->misses = cache.misses;
+  stats->evictions = cache.evictions;
+  stats->entries = cache.entries;
+  stats->bytes = cache.bytes;
+}
@@ -0,0 +1,109 @@
+#pragma once
+// C API for running many emulators in lockstep as a reinforcement learning
+// environment, built as the nes-env shared library. python/nes_env.py wraps
+// it with ctypes.
+//
+// All buffers are owned by the caller and written in place, one contiguous
+// slot per environment.
+#include <stddef.h>
+#include <stdint.h>
+
+// Define NES_ENV_STATIC when compiling the sources straight into a program
+#if defined(NES_ENV_STATIC)
+#define NES_ENV_API
+#elif defined(_WIN32)
+#ifdef NES_ENV_BUILD
+#define NES_ENV_API __declspec(dllexport)
+#else
+#define NES_ENV_API __declspec(dllimport)
+#endif
+#else
+#define NES_ENV_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  NES_ENV_OBS_PIXELS = 0,  // 240x256 RGB, 184320 bytes
+  NES_ENV_OBS_RAM = 1,     // the 2 KB of internal RAM
+  // frame_stack planes of obs_height x obs_width luma, oldest first
+  NES_ENV_OBS_GREYSCALE = 2,
+};
+
+typedef struct NesEnvConfig {
+  int num_envs;
+  int num_threads;  // including the calling thread, 0 for one per core
+  int observation;  // NES_ENV_OBS_*
+  int frameskip;    // frames per step, each with the same action
+  int max_pool;  // pixels or luma are the max of the last two frames of a step
+  // Each reset runs a number of frames with no input picked from its seed in
+  // [0, noop_max], followed by the frame that's observed
+  int noop_max;
+  int max_episode_steps;  // 0 for no limit
+  // The reward for a step is how much the little endian number at this CPU
+  // address (RAM or cartridge) changed, or 0 if the address is -1
+  int reward_address;
+  int reward_bytes;  // 1 to 4
+  // The episode ends when the byte at this address equals done_value, unless
+  // the address is -1
+  int done_address;
+  int done_value;
+  // Greyscale observations: the frame is cropped by these many pixels on each
+  // edge and area-averaged down to obs_width x obs_height, and each step's
+  // is stacked after those of the frame_stack - 1 steps before it
+  int obs_width;
+  int obs_height;
+  int crop_top;
+  int crop_bottom;
+  int crop_left;
+  int crop_right;
+  int frame_stack;
+  // Megabytes for a cache of the state each frame leads to from a given state
+  // and action, shared by all environments, or 0 for none. Frames that are
+  // observed as pixels or greyscale always run.
+  int cache_mb;
+} NesEnvConfig;
+
+typedef struct NesEnvCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t entries;
+  uint64_t bytes;
+} NesEnvCacheStats;
+
+typedef struct NesEnv NesEnv;
+
+NES_ENV_API void nes_env_default_config(NesEnvConfig* config);
+// Returns null if the rom can't be loaded
+NES_ENV_API NesEnv* nes_env_create(const char* rom, const NesEnvConfig* config);
+NES_ENV_API void nes_env_destroy(NesEnv* env);
+NES_ENV_API int nes_env_num_envs(const NesEnv* env);
+// Bytes of observation per environment
+NES_ENV_API size_t nes_env_observation_size(const NesEnv* env);
+
+// Resets every environment. seeds has one per environment, or is null to use
+// 0, 1, 2, ... observations has num_envs * observation_size bytes.
+NES_ENV_API void nes_env_reset(NesEnv* env,
+                               const uint64_t* seeds,
+                               uint8_t* observations);
+// Steps every environment with its action, a bit mask of joypad 1 buttons
+// (A, B, Select, Start, Up, Down, Left, Right from the low bit). Episodes that
+// end are reset straight away with a new seed, so their observation is the
+// first of the next episode while their reward and done flag are for the step
+// that ended it. rewards and dones may be null.
+NES_ENV_API void nes_env_step(NesEnv* env,
+                              const uint8_t* actions,
+                              uint8_t* observations,
+                              float* rewards,
+                              uint8_t* dones);
+
+// All zero if the cache is disabled
+NES_ENV_API void nes_env_cache_stats(const NesEnv* env,
+                                     NesEnvCacheStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
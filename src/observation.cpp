@@ -0,0 +1,190 @@
+#include "observation.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OBSERVATION_SSE2
+#endif
+
+namespace {
+
+int rgb_luma(int r, int g, int b) {
+  return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+// acc[x] += weight * row[x] for x < count, rounded up to a multiple of 16
+void accumulate(float* acc, const uint8_t* row, float weight, int count) {
+#ifdef OBSERVATION_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 w = _mm_set1_ps(weight);
+  for (int x = 0; x < count; x += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)&row[x]);
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128i words[4] = {
+        _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+        _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+    for (int i = 0; i < 4; i++) {
+      float* a = &acc[x + i * 4];
+      __m128 value = _mm_mul_ps(_mm_cvtepi32_ps(words[i]), w);
+      _mm_storeu_ps(a, _mm_add_ps(_mm_loadu_ps(a), value));
+    }
+  }
+#else
+  for (int x = 0; x < count; x++) {
+    acc[x] += weight * row[x];
+  }
+#endif
+}
+
+// row[x] = max(row[x], pool[x])
+void max_row(uint8_t* row, const uint8_t* pool, int count) {
+  int x = 0;
+#ifdef OBSERVATION_SSE2
+  for (; x + 16 <= count; x += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)&row[x]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&pool[x]);
+    _mm_storeu_si128((__m128i*)&row[x], _mm_max_epu8(a, b));
+  }
+#endif
+  for (; x < count; x++) {
+    row[x] = std::max(row[x], pool[x]);
+  }
+}
+
+}  // namespace
+
+void ObservationProcessor::configure(const ObservationFormat& format) {
+  format_ = format;
+  ObservationFormat& f = format_;
+  f.crop_top = std::min(std::max(f.crop_top, 0), 239);
+  f.crop_bottom = std::min(std::max(f.crop_bottom, 0), 239 - f.crop_top);
+  f.crop_left = std::min(std::max(f.crop_left, 0), 255);
+  f.crop_right = std::min(std::max(f.crop_right, 0), 255 - f.crop_left);
+  crop_width = 256 - f.crop_left - f.crop_right;
+  crop_height = 240 - f.crop_top - f.crop_bottom;
+  f.width = std::min(std::max(f.width, 1), crop_width);
+  f.height = std::min(std::max(f.height, 1), crop_height);
+
+  // Coverage is worked out in integers, in units of 1 / output size of an
+  // input pixel, so the weights of each output add up exactly
+  int w = f.width;
+  int h = f.height;
+  float area = (float)crop_width / w * crop_height / h;
+  max_x_taps = (crop_width + w - 1) / w + 1;
+  x_taps.resize(w);
+  x_weights.assign(w * max_x_taps, 0.0f);
+  for (int x = 0; x < w; x++) {
+    int begin = x * crop_width;  // in units of 1 / w input pixels
+    int end = (x + 1) * crop_width;
+    Taps& taps = x_taps[x];
+    taps.start = begin / w;
+    taps.count = (end + w - 1) / w - taps.start;
+    for (int k = 0; k < taps.count; k++) {
+      int pixel = taps.start + k;
+      int covered =
+          std::min(end, (pixel + 1) * w) - std::max(begin, pixel * w);
+      x_weights[x * max_x_taps + k] = (float)covered / w / area;
+    }
+  }
+
+  first_row.resize(crop_height);
+  for (int i = 0; i < 2; i++) {
+    row_weights[i].assign(crop_height, 0.0f);
+  }
+  for (int r = 0; r < crop_height; r++) {
+    int y = r * h / crop_height;
+    int boundary = (y + 1) * crop_height;  // in units of 1 / h rows
+    first_row[r] = y;
+    row_weights[0][r] = (float)(std::min((r + 1) * h, boundary) - r * h) / h;
+    if ((r + 1) * h > boundary) {
+      row_weights[1][r] = (float)((r + 1) * h - boundary) / h;
+    }
+  }
+}
+
+void ObservationProcessor::set_palette(const Palette& palette) {
+  for (int i = 0; i < Palette::size; i++) {
+    const uint8_t* rgb = palette.lut[i];
+    luma_lut[i] = rgb_luma(rgb[0], rgb[1], rgb[2]);
+  }
+}
+
+void ObservationProcessor::luma(const uint16_t (&indices)[240][256],
+                                uint8_t* out) const {
+  for (int r = 0; r < crop_height; r++) {
+    const uint16_t* in = &indices[r + format_.crop_top][format_.crop_left];
+    uint8_t* row = out + r * crop_width;
+    for (int x = 0; x < crop_width; x++) {
+      row[x] = luma_lut[in[x] & (Palette::size - 1)];
+    }
+  }
+}
+
+void ObservationProcessor::process(const uint16_t (&indices)[240][256],
+                                   const uint8_t* pool,
+                                   uint8_t* out) const {
+  process_rows(
+      [&](int r, uint8_t* row) {
+        const uint16_t* in =
+            &indices[r + format_.crop_top][format_.crop_left];
+        for (int x = 0; x < crop_width; x++) {
+          row[x] = luma_lut[in[x] & (Palette::size - 1)];
+        }
+      },
+      pool, out);
+}
+
+void ObservationProcessor::process(const uint8_t (&pixels)[240][256][3],
+                                   const uint8_t* pool,
+                                   uint8_t* out) const {
+  process_rows(
+      [&](int r, uint8_t* row) {
+        const uint8_t(*in)[3] =
+            &pixels[r + format_.crop_top][format_.crop_left];
+        for (int x = 0; x < crop_width; x++) {
+          row[x] = rgb_luma(in[x][0], in[x][1], in[x][2]);
+        }
+      },
+      pool, out);
+}
+
+template <typename RowLuma>
+void ObservationProcessor::process_rows(RowLuma row_luma,
+                                        const uint8_t* pool,
+                                        uint8_t* out) const {
+  // Input rows are added into the one or two output rows they overlap, and
+  // each output row is scaled horizontally once its last input row is in.
+  // Everything is padded to 256 so the vector loops can run past the crop.
+  uint8_t row[256] = {0};
+  float acc[2][256] = {{0}};
+  for (int r = 0; r < crop_height; r++) {
+    row_luma(r, row);
+    if (pool) {
+      max_row(row, pool + r * crop_width, crop_width);
+    }
+    int y = first_row[r];
+    accumulate(acc[y & 1], row, row_weights[0][r], crop_width);
+    if (row_weights[1][r] > 0.0f) {
+      accumulate(acc[(y + 1) & 1], row, row_weights[1][r], crop_width);
+    }
+    if (r + 1 < crop_height && first_row[r + 1] == y) {
+      continue;
+    }
+
+    float* sums = acc[y & 1];
+    uint8_t* out_row = out + y * format_.width;
+    for (int x = 0; x < format_.width; x++) {
+      const Taps& taps = x_taps[x];
+      const float* weights = &x_weights[x * max_x_taps];
+      float sum = 0.5f;
+      for (int k = 0; k < taps.count; k++) {
+        sum += weights[k] * sums[taps.start + k];
+      }
+      out_row[x] = (uint8_t)std::min(sum, 255.0f);
+    }
+    std::fill(sums, sums + 256, 0.0f);
+  }
+}
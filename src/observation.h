@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "nes/palette.h"
+
+// Crop and output size of a greyscale observation
+struct ObservationFormat {
+  int width = 84;
+  int height = 84;
+  // Pixels cut from each edge of the 256x240 frame before scaling
+  int crop_top = 0;
+  int crop_bottom = 0;
+  int crop_left = 0;
+  int crop_right = 0;
+};
+
+// Turns a frame into a small greyscale image for reinforcement learning:
+// crops it, takes the BT.601 luma of each pixel and area-averages it down to
+// the output size. Works a row at a time, straight from the PPU's indexed
+// frame (through a luma table built from the palette) or its RGB pixels.
+class ObservationProcessor {
+ public:
+  // Clamps the format to a valid crop that is only ever scaled down
+  void configure(const ObservationFormat& format);
+  void set_palette(const Palette& palette);
+  const ObservationFormat& format() const { return format_; }
+  size_t output_size() const { return format_.width * format_.height; }
+  // Bytes of cropped full resolution luma, as written by luma()
+  size_t luma_size() const { return crop_width * crop_height; }
+
+  // Cropped full resolution luma of a frame, for pooling with a later one
+  void luma(const uint16_t (&indices)[240][256], uint8_t* out) const;
+  // Writes output_size() bytes. If pool is given (luma() of another frame),
+  // each luma pixel is the max of the two frames' before scaling.
+  void process(const uint16_t (&indices)[240][256],
+               const uint8_t* pool,
+               uint8_t* out) const;
+  void process(const uint8_t (&pixels)[240][256][3],
+               const uint8_t* pool,
+               uint8_t* out) const;
+
+ private:
+  struct Taps {
+    int start;
+    int count;
+  };
+
+  ObservationFormat format_;
+  int crop_width = 256;
+  int crop_height = 240;
+  uint8_t luma_lut[Palette::size];
+
+  // Horizontal: output x averages count inputs from start, with weights that
+  // also carry the 1 / area normalization
+  std::vector<Taps> x_taps;
+  std::vector<float> x_weights;  // max_x_taps per output
+  int max_x_taps = 0;
+  // Vertical: each input row adds to output row first_row[r] with
+  // row_weight[r][0], and to the next one with row_weight[r][1]
+  std::vector<int> first_row;
+  std::vector<float> row_weights[2];
+
+  template <typename RowLuma>
+  void process_rows(RowLuma row_luma, const uint8_t* pool, uint8_t* out) const;
+};
@@ -1,5 +1,8 @@
 #include "renderer.h"
+#include <algorithm>
+#include <cfloat>
 #include <cstdio>
+#include <string>
 #include "glfw_keycodes.h"
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
@@ -48,8 +51,8 @@ float transform_matrix[][4] = {
     {0.0f, 0.0f, 0.0f, 1.0f},
 };
 
-uint8_t nametable_pixels[480][512][3];
-uint8_t pattern_table_pixels[128][256][3];
+uint8_t heatmap[0x10000];
+uint8_t heatmap_pixels[256][256][3];
 
 ImVec2 uv(float px, float py) {
   return ImVec2(px / texture_size, py / texture_size);
@@ -72,8 +75,16 @@ const char* gamepad_button_strings[] = {
 void Renderer::render() {
   glfwPollEvents();
   poll_joystick();
+  // The game picks this up when it next latches the joypads, even mid-frame
   set_joypad_state();
 
+  // The emulation thread is only paused while the NES state is copied out.
+  // Settings that change it lock again as they're changed.
+  {
+    std::lock_guard<std::mutex> lock(emulation.mutex);
+    read_nes();
+  }
+
   // Update texture from NES data
   update_texture();
 
@@ -87,8 +98,13 @@ void Renderer::render() {
   // Main screen
   ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_Once);
   if (ImGui::Begin("NES Screen", nullptr, window_flags)) {
-    ImGui::Image((ImTextureID)texture, ImVec2(512, 480), uv(0, 0),
-                 uv(256, 240));
+    if (video_filter != VideoFilterType::None && filtered_width > 0) {
+      ImGui::Image((ImTextureID)filtered_texture, ImVec2(512, 480), uv(0, 0),
+                   uv(filtered_width, filtered_height));
+    } else {
+      ImGui::Image((ImTextureID)texture, ImVec2(512, 480), uv(0, 0),
+                   uv(256, 240));
+    }
   }
   ImGui::End();
 
@@ -100,6 +116,8 @@ void Renderer::render() {
     ImGui::Text("");
     render_controls();
     render_audio_settings();
+    render_video_settings();
+    render_run_ahead_settings();
   }
   ImGui::End();
 
@@ -123,17 +141,26 @@ void Renderer::render() {
   ImGui::SetNextWindowPos(ImVec2(0, 480 + 16 + 16 + 3), ImGuiCond_Once);
   ImGui::SetNextWindowContentSize(ImVec2(512, 256));
   if (ImGui::Begin("Audio Channels", nullptr, window_flags)) {
+    update_waveforms();
     ImVec2 plot_size(425.0f, 45.0f);
     const char* channel_names[5] = {"Pulse 1", "Pulse 2", "Triangle", "Noise",
                                     "DMC"};
     for (int i = 0; i < 5; i++) {
-      auto& waveform = nes.apu.debug_waveforms[i];
+      auto& waveform = waveforms[i];
       ImGui::PlotLines(channel_names[i], waveform.output_buffer,
                        waveform.buffer_size, 0, nullptr, 0, 1.0f, plot_size);
     }
+  } else if (waveform_reader) {
+    // Collapsed, so stop the APU publishing samples nobody will see. The tap
+    // has its own lock.
+    nes.apu.tap.detach(waveform_reader);
+    waveform_reader.reset();
   }
   ImGui::End();
 
+  render_performance();
+  render_profiler();
+
   glClearColor(0.25f, 0.25f, 0.25f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT);
 
@@ -145,6 +172,16 @@ void Renderer::render() {
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
   glfwSwapBuffers(window);
+
+  // Time from an input change to the swap that shows the first frame in which
+  // the game latched it
+  if (shown_input_serial != measured_input_serial) {
+    measured_input_serial = shown_input_serial;
+    std::chrono::duration<float, std::milli> latency =
+        std::chrono::steady_clock::now() - shown_input_time;
+    latency_history[latency_history_offset] = latency.count();
+    latency_history_offset = (latency_history_offset + 1) % perf_history_size;
+  }
 }
 
 bool Renderer::init() {
@@ -164,6 +201,9 @@ bool Renderer::init() {
   glfwSetWindowUserPointer(window, this);
 
   init_input_bindings();
+  for (int i = 0; i < 5; i++) {
+    pans[i] = nes.apu.get_pan(i);
+  }
   auto key_callback = [](GLFWwindow* window, int key, int scancode, int action,
                          int mods) {
     static_cast<Renderer*>(glfwGetWindowUserPointer(window))
@@ -227,6 +267,15 @@ bool Renderer::init() {
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_size, texture_size, 0, GL_RGB,
                GL_UNSIGNED_BYTE, nullptr);
 
+  // Filtered screen texture, which is scaled down to fit the screen window
+  glGenTextures(1, &filtered_texture);
+  glBindTexture(GL_TEXTURE_2D, filtered_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture_size, texture_size, 0, GL_RGB,
+               GL_UNSIGNED_BYTE, nullptr);
+  glBindTexture(GL_TEXTURE_2D, texture);
+
   glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float),
                         (void*)(3 * sizeof(float)));
   glEnableVertexAttribArray(1);
@@ -310,20 +359,108 @@ double Renderer::time() {
   return glfwGetTime();
 }
 
-void Renderer::set_pixels(uint8_t* pixels, int x, int y, int w, int h) {
+void Renderer::set_pixels(const uint8_t* pixels, int x, int y, int w, int h) {
   glBindTexture(GL_TEXTURE_2D, texture);
   glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGB, GL_UNSIGNED_BYTE,
                   pixels);
 }
 
+void Renderer::set_pixel_rects(const uint8_t* pixels,
+                               int row_length,
+                               int x,
+                               int y,
+                               const std::vector<DirtyRect>& rects) {
+  if (rects.empty()) {
+    return;
+  }
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+  for (const DirtyRect& rect : rects) {
+    const uint8_t* start = pixels + (rect.y * row_length + rect.x) * 3;
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x + rect.x, y + rect.y, rect.w, rect.h,
+                    GL_RGB, GL_UNSIGNED_BYTE, start);
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void Renderer::read_nes() {
+  // Only the tiles that changed are redrawn
+  nametables_dirty.clear();
+  pattern_tables_dirty.clear();
+  debug_views.update(nametables_dirty, pattern_tables_dirty);
+
+#ifdef NES_PERF_COUNTERS
+  perf = nes.perf;
+#endif
+
+  const RunAhead& run_ahead = emulation.run_ahead;
+  run_ahead_view.frames = run_ahead.frames;
+  run_ahead_view.auto_frames = run_ahead.auto_frames;
+  run_ahead_view.frame_ms = run_ahead.frame_ms;
+  run_ahead_view.hidden_frame_ms = run_ahead.hidden_frame_ms;
+  run_ahead_view.snapshot_ms = run_ahead.snapshot_ms;
+  run_ahead_view.cost_ms = run_ahead.cost_ms(run_ahead.frames);
+
+#ifdef NES_PROFILE
+  if (profiler_open) {
+    nes.profiler.heatmap(heatmap);
+  }
+  profiler_hover_valid =
+      profiler_hover >= 0 && !nes.profiler.addresses.empty();
+  if (profiler_hover_valid) {
+    profiler_hover_counts = nes.profiler.addresses[profiler_hover];
+  }
+#endif
+}
+
 void Renderer::update_texture() {
-  set_pixels(&nes.ppu.pixels[0][0][0], 0, 0, 256, 240);
+  PERF_TIMER(nes.perf, update_texture_ms);
+  const Frame& frame = emulation.frame();
+  set_pixels(&frame.pixels[0][0][0], 0, 0, 256, 240);
+  shown_input_serial = frame.input_serial;
+  shown_input_time = frame.input_time;
+
+  // The filter runs on a worker thread, so its output is a frame behind
+  if (video_filter != VideoFilterType::None) {
+    if (!filter_thread) {
+      filter_thread = std::make_unique<VideoFilterThread>();
+    }
+    if (!filter_thread->busy()) {
+      if (filter_pending) {
+        const FilteredFrame& filtered = filter_thread->wait();
+        filtered_width = filtered.width;
+        filtered_height = filtered.height;
+        glBindTexture(GL_TEXTURE_2D, filtered_texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, filtered.width,
+                        filtered.height, GL_RGB, GL_UNSIGNED_BYTE,
+                        filtered.pixels.data());
+        glBindTexture(GL_TEXTURE_2D, texture);
+      }
+      filter_thread->submit(video_filter, frame.pixels);
+      filter_pending = true;
+    }
+  }
 
-  nes.ppu.render_nametables(nametable_pixels);
-  set_pixels(&nametable_pixels[0][0][0], 256, 0, 512, 480);
+  // Only the tiles read_nes() redrew are uploaded
+  set_pixel_rects(&debug_views.nametables[0][0][0], 512, 256, 0,
+                  nametables_dirty);
+  set_pixel_rects(&debug_views.pattern_tables[0][0][0], 256, 0, 256,
+                  pattern_tables_dirty);
+}
 
-  nes.ppu.render_pattern_tables(pattern_table_pixels);
-  set_pixels(&pattern_table_pixels[0][0][0], 0, 256, 256, 128);
+void Renderer::update_waveforms() {
+  if (!waveform_reader) {
+    waveform_reader = nes.apu.tap.attach(44100);
+  }
+  ChannelLevels levels[256];
+  size_t count;
+  while ((count = waveform_reader->read(levels, 256)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      for (int j = 0; j < 5; j++) {
+        waveforms[j].add_sample(levels[i].level[j]);
+      }
+    }
+  }
 }
 
 void Renderer::init_input_bindings() {
@@ -377,11 +514,196 @@ void Renderer::render_audio_settings() {
                               ImGuiTreeNodeFlags_DefaultOpen)) {
     static float volume = 1.0f;
     if (ImGui::SliderFloat("Volume", &volume, 0, 1.0f)) {
+      std::lock_guard<std::mutex> lock(emulation.mutex);
       nes.apu.set_volume(volume * INT16_MAX);
     }
+
+    Audio& audio = emulation.get_audio();
+    const int rates[] = {22050, 32000, 44100, 48000, 96000};
+    char label[32];
+    snprintf(label, sizeof(label), "%d Hz", audio.get_frequency());
+    if (ImGui::BeginCombo("Output rate", label)) {
+      for (int rate : rates) {
+        snprintf(label, sizeof(label), "%d Hz", rate);
+        if (ImGui::Selectable(label, rate == audio.get_frequency())) {
+          std::lock_guard<std::mutex> lock(emulation.mutex);
+          audio.set_frequency(rate);
+        }
+      }
+      ImGui::EndCombo();
+    }
+
+    const char* pan_names[5] = {"Pulse 1 pan", "Pulse 2 pan", "Triangle pan",
+                                "Noise pan", "DMC pan"};
+    for (int i = 0; i < 5; i++) {
+      if (ImGui::SliderFloat(pan_names[i], &pans[i], -1.0f, 1.0f)) {
+        std::lock_guard<std::mutex> lock(emulation.mutex);
+        nes.apu.set_pan(i, pans[i]);
+      }
+    }
   }
 }
 
+void Renderer::render_video_settings() {
+  if (ImGui::CollapsingHeader("Video Settings",
+                              ImGuiTreeNodeFlags_DefaultOpen)) {
+    if (ImGui::BeginCombo("Filter", video_filter_name(video_filter))) {
+      for (int i = 0; i < (int)VideoFilterType::Count; i++) {
+        VideoFilterType type = (VideoFilterType)i;
+        if (ImGui::Selectable(video_filter_name(type), type == video_filter)) {
+          video_filter = type;
+        }
+      }
+      ImGui::EndCombo();
+    }
+
+    bool changed = false;
+    if (ImGui::Checkbox("NTSC palette", &palette_generated)) {
+      changed = true;
+    }
+    if (palette_generated) {
+      changed |= ImGui::SliderFloat("Hue", &palette_model.hue, -30, 30);
+      changed |=
+          ImGui::SliderFloat("Saturation", &palette_model.saturation, 0, 2);
+      changed |= ImGui::SliderFloat("Contrast", &palette_model.contrast, 0.5f,
+                                    1.5f);
+      changed |= ImGui::SliderFloat("Brightness", &palette_model.brightness,
+                                    -0.5f, 0.5f);
+      changed |= ImGui::SliderFloat("Gamma", &palette_model.gamma, 1.0f, 3.0f);
+    }
+    if (changed) {
+      std::lock_guard<std::mutex> lock(emulation.mutex);
+      if (palette_generated) {
+        nes.palette.generate(palette_model);
+      } else {
+        nes.palette.set_default();
+      }
+    }
+    ImGui::Text("Drop a .pal file to load a palette");
+  }
+}
+
+void Renderer::render_run_ahead_settings() {
+  if (ImGui::CollapsingHeader("Run-Ahead", ImGuiTreeNodeFlags_DefaultOpen)) {
+    RunAheadView& view = run_ahead_view;
+    if (ImGui::Checkbox("Auto", &view.auto_frames)) {
+      std::lock_guard<std::mutex> lock(emulation.mutex);
+      emulation.run_ahead.auto_frames = view.auto_frames;
+    }
+    ImGui::BeginDisabled(view.auto_frames);
+    if (ImGui::SliderInt("Frames", &view.frames, 0, RunAhead::max_frames)) {
+      std::lock_guard<std::mutex> lock(emulation.mutex);
+      emulation.run_ahead.frames = view.frames;
+    }
+    ImGui::EndDisabled();
+    ImGui::Text("Frame: %.2f ms, hidden: %.2f ms", view.frame_ms,
+                view.hidden_frame_ms);
+    ImGui::Text("Snapshot: %.3f ms, total: %.2f ms", view.snapshot_ms,
+                view.cost_ms);
+  }
+}
+
+void Renderer::render_performance() {
+#ifdef NES_PERF_COUNTERS
+  const char* names[num_perf_metrics] = {
+      "Instructions", "Cycles",   "PPU writes",     "Bank switches",
+      "DMA stalls",   "IRQs",     "run_frame (ms)", "update_texture (ms)",
+      "Audio (ms)",
+  };
+  float values[num_perf_metrics] = {
+      (float)(perf.instructions - last_perf.instructions),
+      (float)(perf.cycles - last_perf.cycles),
+      (float)(perf.ppu_register_writes - last_perf.ppu_register_writes),
+      (float)(perf.bank_switches - last_perf.bank_switches),
+      (float)(perf.dma_stall_cycles - last_perf.dma_stall_cycles),
+      (float)(perf.irqs + perf.nmis - last_perf.irqs - last_perf.nmis),
+      (float)(perf.run_frame_ms - last_perf.run_frame_ms),
+      (float)(perf.update_texture_ms - last_perf.update_texture_ms),
+      (float)(perf.audio_output_ms - last_perf.audio_output_ms),
+  };
+  last_perf = perf;
+  for (int i = 0; i < num_perf_metrics; i++) {
+    perf_history[i][perf_history_offset] = values[i];
+  }
+  perf_history_offset = (perf_history_offset + 1) % perf_history_size;
+#endif
+
+  ImGui::SetNextWindowPos(ImVec2(512 + 512 + 16 * 2, window_height / 2),
+                          ImGuiCond_Once);
+  ImGui::SetNextWindowCollapsed(true, ImGuiCond_Once);
+  if (ImGui::Begin("Performance")) {
+    ImVec2 plot_size(256.0f, 40.0f);
+    // The last input changes rather than frames, so it holds still while no
+    // buttons change
+    char latency_overlay[48];
+    int last = (latency_history_offset + perf_history_size - 1) %
+               perf_history_size;
+    snprintf(latency_overlay, sizeof(latency_overlay),
+             "Input to display (ms): %.1f", latency_history[last]);
+    ImGui::PlotHistogram("##latency", latency_history, perf_history_size,
+                         latency_history_offset, latency_overlay, 0, FLT_MAX,
+                         plot_size);
+#ifdef NES_PERF_COUNTERS
+    for (int i = 0; i < num_perf_metrics; i++) {
+      char overlay[32];
+      snprintf(overlay, sizeof(overlay), "%s: %.*f", names[i], i >= 6 ? 2 : 0,
+               values[i]);
+      ImGui::PushID(i);
+      ImGui::PlotHistogram("", perf_history[i], perf_history_size,
+                           perf_history_offset, overlay, 0, FLT_MAX,
+                           plot_size);
+      ImGui::PopID();
+    }
+#endif
+  }
+  ImGui::End();
+}
+
+void Renderer::render_profiler() {
+#ifdef NES_PROFILE
+  ImGui::SetNextWindowPos(ImVec2(512 + 16, 480 + 16 + 16 + 3), ImGuiCond_Once);
+  ImGui::SetNextWindowCollapsed(true, ImGuiCond_Once);
+  profiler_open = ImGui::Begin("CPU Heatmap");
+  if (profiler_open) {
+    // Black -> red -> yellow -> white with increasing (log) cycles spent at
+    // each address, as of read_nes(). Rows are 256 byte pages.
+    for (int i = 0; i < 0x10000; i++) {
+      int v = heatmap[i] * 3;
+      uint8_t* pixel = heatmap_pixels[i / 256][i % 256];
+      pixel[0] = std::min(v, 255);
+      pixel[1] = std::min(std::max(v - 255, 0), 255);
+      pixel[2] = std::max(v - 510, 0);
+    }
+    set_pixels(&heatmap_pixels[0][0][0], 0, 384, 256, 256);
+
+    ImVec2 pos = ImGui::GetCursorScreenPos();
+    ImGui::Image((ImTextureID)texture, ImVec2(512, 512), uv(0, 384),
+                 uv(256, 384 + 256));
+    if (ImGui::IsItemHovered()) {
+      // The counts are read for the next frame, so the tooltip trails the
+      // mouse by one
+      ImVec2 mouse = ImGui::GetIO().MousePos;
+      int x = std::min(std::max((int)(mouse.x - pos.x) / 2, 0), 255);
+      int y = std::min(std::max((int)(mouse.y - pos.y) / 2, 0), 255);
+      if (profiler_hover_valid && profiler_hover == y * 256 + x) {
+        const ProfileCounts& counts = profiler_hover_counts;
+        ImGui::SetTooltip("$%04X: %llu executions, %llu cycles",
+                          profiler_hover, (unsigned long long)counts.executions,
+                          (unsigned long long)counts.cycles);
+      }
+      profiler_hover = y * 256 + x;
+    } else {
+      profiler_hover = -1;
+    }
+    if (ImGui::Button("Reset")) {
+      std::lock_guard<std::mutex> lock(emulation.mutex);
+      nes.profiler.reset();
+    }
+  }
+  ImGui::End();
+#endif
+}
+
 void Renderer::poll_joystick() {
 #ifdef __EMSCRIPTEN__
   EmscriptenGamepadEvent event;
@@ -425,10 +747,11 @@ void Renderer::poll_joystick() {
 }
 
 void Renderer::set_joypad_state() {
+  uint8_t buttons = 0;
   for (int i = 0; i < (int)Button::Count; i++) {
-    nes.joypad.set_button_state(0, (Button)i,
-                                key_states[i] || gamepad_states[i]);
+    buttons |= (key_states[i] || gamepad_states[i]) << i;
   }
+  emulation.input.set_buttons(buttons);
 }
 
 void Renderer::key_callback(int key, int scancode, int action, int mods) {
@@ -456,5 +779,12 @@ void Renderer::key_callback(int key, int scancode, int action, int mods) {
 }
 
 void Renderer::drop_callback(int count, const char** paths) {
-  nes.load(paths[0]);
+  std::lock_guard<std::mutex> lock(emulation.mutex);
+  std::string path = paths[0];
+  if (path.size() > 4 && path.compare(path.size() - 4, 4, ".pal") == 0) {
+    palette_generated = false;
+    nes.palette.load(paths[0]);
+  } else {
+    nes.load(paths[0]);
+  }
 }
\ No newline at end of file
@@ -6,9 +6,14 @@
 #include <glad/gl.h>
 #endif
 #include <GLFW/glfw3.h>
+#include <memory>
 #include <unordered_map>
 #include <vector>
+#include "emulation_thread.h"
+#include "nes/debug_views.h"
 #include "nes/nes.h"
+#include "nes/waveform_capture.h"
+#include "video_filter.h"
 
 struct InputBinding {
   const char* name;
@@ -19,7 +24,8 @@ struct InputBinding {
 
 class Renderer {
  public:
-  Renderer(NES& nes) : nes(nes) {}
+  Renderer(NES& nes, EmulationThread& emulation)
+      : nes(nes), emulation(emulation), debug_views(nes) {}
   bool init();
   void destroy();
   void render();
@@ -28,6 +34,7 @@ class Renderer {
 
  private:
   NES& nes;
+  EmulationThread& emulation;
 
   GLFWwindow* window = nullptr;
 
@@ -35,6 +42,10 @@ class Renderer {
   unsigned int VBO;
   unsigned int EBO;
   unsigned int texture;
+  unsigned int filtered_texture;  // screen after the video filter
+  DebugViews debug_views;
+  std::vector<DirtyRect> nametables_dirty;
+  std::vector<DirtyRect> pattern_tables_dirty;
   std::vector<float> vertices;
   std::vector<unsigned int> indices;
 
@@ -52,7 +63,15 @@ class Renderer {
                 float u,
                 float v,
                 float uv_scale = 1.0f);
-  void set_pixels(uint8_t* pixels, int x, int y, int w, int h);
+  void set_pixels(const uint8_t* pixels, int x, int y, int w, int h);
+  // Uploads the given areas of an image with the given row length
+  void set_pixel_rects(const uint8_t* pixels,
+                       int row_length,
+                       int x,
+                       int y,
+                       const std::vector<DirtyRect>& rects);
+  // Copies what the UI shows of the NES, with the emulation thread paused
+  void read_nes();
   void update_texture();
 
   // TODO: Move input stuff out of renderer?
@@ -81,13 +100,65 @@ class Renderer {
       {"Right", Button::Right, GLFW_KEY_RIGHT, GLFW_GAMEPAD_BUTTON_DPAD_RIGHT},
   };
 #endif
+  bool palette_generated = false;
+  PaletteModel palette_model;
+
+  VideoFilterType video_filter = VideoFilterType::None;
+  std::unique_ptr<VideoFilterThread> filter_thread;
+  bool filter_pending = false;
+  int filtered_width = 0;
+  int filtered_height = 0;
+
+  // Oscilloscope, fed from the APU's audio tap only while its window is open
+  std::shared_ptr<AudioTapReader> waveform_reader;
+  float pans[5] = {0};  // slider values, read from the APU in init()
+  WaveformCapture waveforms[5] = {{15, 1}, {15, 1}, {15, 8}, {15, 1}, {127, 1}};
+
   std::unordered_map<int, InputBinding*> input_mapping;
   int remapping_binding = -1;
   bool key_states[(int)Button::Count] = {false};
   bool gamepad_states[(int)Button::Count] = {false};
 
+  // Copied from emulation.run_ahead, which the emulation thread updates
+  struct RunAheadView {
+    int frames = 0;
+    bool auto_frames = false;
+    double frame_ms = 0;
+    double hidden_frame_ms = 0;
+    double snapshot_ms = 0;
+    double cost_ms = 0;
+  };
+  RunAheadView run_ahead_view;
+
+  // Profiler window state as of the last frame, and the counts under the
+  // mouse then
+  bool profiler_open = false;
+  int profiler_hover = -1;
+  bool profiler_hover_valid = false;
+  ProfileCounts profiler_hover_counts;
+
+  // Per-frame deltas of the performance counters for the last few seconds
+  static constexpr int num_perf_metrics = 9;
+  static constexpr int perf_history_size = 120;
+  PerfCounters perf;  // copied from the NES this frame
+  PerfCounters last_perf;
+  float perf_history[num_perf_metrics][perf_history_size] = {{0}};
+  int perf_history_offset = 0;
+
+  // Input to display latency, per input change
+  uint32_t shown_input_serial = 0;
+  uint32_t measured_input_serial = 0;
+  std::chrono::steady_clock::time_point shown_input_time;
+  float latency_history[perf_history_size] = {0};
+  int latency_history_offset = 0;
+
+  void update_waveforms();
   void render_controls();
   void render_audio_settings();
+  void render_video_settings();
+  void render_run_ahead_settings();
+  void render_performance();
+  void render_profiler();
   void init_input_bindings();
   void poll_joystick();
   void set_joypad_state();
@@ -0,0 +1,146 @@
+#include "rollback.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+// Packet: ack frame (int32), start frame (int32), count (uint8), inputs
+constexpr int header_size = 9;
+constexpr int max_inputs_per_packet = 64;
+
+}  // namespace
+
+RollbackSession::RollbackSession(NES& nes,
+                                 Transport& transport,
+                                 int local_player)
+    : nes(nes), transport(transport), local_player(local_player) {}
+
+bool RollbackSession::advance_frame(uint8_t local_input) {
+  receive();
+  rollback();
+  update_confirmed_hashes();
+
+  if (current_frame - remote_confirmed > max_rollback_frames) {
+    stats.stalls++;
+    send();
+    return false;
+  }
+  local_inputs[current_frame % input_history] = local_input;
+  run_frame(current_frame, true);
+  current_frame++;
+  send();
+  update_confirmed_hashes();
+  return true;
+}
+
+int RollbackSession::confirmed_frame() const {
+  return std::min(remote_confirmed, current_frame - 1);
+}
+
+uint8_t RollbackSession::predict(int frame) {
+  if (frame <= remote_confirmed) {
+    return remote_inputs[frame % input_history];
+  }
+  return remote_confirmed >= 0 ? remote_inputs[remote_confirmed % input_history]
+                               : 0;
+}
+
+void RollbackSession::run_frame(int frame, bool output) {
+  nes.save_state(snapshots[frame % num_snapshots]);
+  uint8_t remote_input = predict(frame);
+  predicted_inputs[frame % input_history] = remote_input;
+  nes.joypad.set_buttons(local_player, local_inputs[frame % input_history]);
+  nes.joypad.set_buttons(1 - local_player, remote_input);
+  nes.ppu.output_enabled = output;
+  nes.apu.output_enabled = output;
+  nes.run_frame();
+  nes.ppu.output_enabled = true;
+  nes.apu.output_enabled = true;
+}
+
+void RollbackSession::receive() {
+  uint8_t packet[header_size + max_inputs_per_packet];
+  int size;
+  while ((size = transport.receive(packet, sizeof(packet))) >= 0) {
+    if (size < header_size || size != header_size + packet[8]) {
+      continue;
+    }
+    int32_t ack, start;
+    memcpy(&ack, packet, 4);
+    memcpy(&start, packet + 4, 4);
+    remote_ack = std::max(remote_ack, (int)ack);
+    for (int i = 0; i < packet[8]; i++) {
+      int frame = start + i;
+      // Inputs arrive in order within a packet, and each packet starts at or
+      // before the first frame we're missing, so there are no gaps
+      if (frame != remote_confirmed + 1) {
+        continue;
+      }
+      uint8_t input = packet[header_size + i];
+      remote_inputs[frame % input_history] = input;
+      remote_confirmed = frame;
+      if (frame < current_frame &&
+          predicted_inputs[frame % input_history] != input &&
+          (first_mispredicted < 0 || frame < first_mispredicted)) {
+        first_mispredicted = frame;
+      }
+    }
+  }
+}
+
+void RollbackSession::send() {
+  // Resend everything the remote hasn't acknowledged yet, so lost packets
+  // don't need their own retransmission
+  int start = std::max(remote_ack + 1, current_frame - max_inputs_per_packet);
+  int count = current_frame - start;
+  uint8_t packet[header_size + max_inputs_per_packet];
+  int32_t ack = remote_confirmed;
+  int32_t start32 = start;
+  memcpy(packet, &ack, 4);
+  memcpy(packet + 4, &start32, 4);
+  packet[8] = (uint8_t)count;
+  for (int i = 0; i < count; i++) {
+    packet[header_size + i] = local_inputs[(start + i) % input_history];
+  }
+  transport.send(packet, header_size + count);
+}
+
+void RollbackSession::rollback() {
+  if (first_mispredicted < 0) {
+    return;
+  }
+  auto start_time = std::chrono::steady_clock::now();
+  int frame = first_mispredicted;
+  first_mispredicted = -1;
+  nes.load_state(snapshots[frame % num_snapshots]);
+  for (int i = frame; i < current_frame; i++) {
+    run_frame(i, false);
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start_time;
+
+  stats.rollbacks++;
+  stats.rollback_frames += current_frame - frame;
+  stats.last_rollback_ms = elapsed.count();
+  stats.max_rollback_ms = std::max(stats.max_rollback_ms, elapsed.count());
+}
+
+void RollbackSession::update_confirmed_hashes() {
+  if (!record_hashes) {
+    return;
+  }
+  int frame;
+  while ((frame = (int)confirmed_hashes.size()) <= confirmed_frame()) {
+    // The state after a frame is the snapshot taken before the next one
+    if (frame + 1 < current_frame) {
+      const std::vector<uint8_t>& snapshot =
+          snapshots[(frame + 1) % num_snapshots];
+      StateHasher hasher;
+      hasher.update(snapshot.data(), snapshot.size());
+      confirmed_hashes.push_back(hasher.digest());
+    } else {
+      confirmed_hashes.push_back(nes.state_hash());
+    }
+  }
+}
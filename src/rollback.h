@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "nes/nes.h"
+#include "transport.h"
+
+// Two player netplay with rollback. Each side runs ahead on its own input and
+// a prediction of the remote input (the last one received). When the real
+// remote input for an earlier frame turns out different, the session restores
+// the snapshot from that frame and re-simulates up to the current one with
+// output suppressed.
+class RollbackSession {
+ public:
+  static constexpr int max_rollback_frames = 8;
+
+  struct Stats {
+    int rollbacks = 0;
+    int rollback_frames = 0;
+    int stalls = 0;  // frames waited because the remote was too far behind
+    double last_rollback_ms = 0;
+    double max_rollback_ms = 0;
+  };
+  Stats stats;
+
+  // If set, the state hash after each confirmed frame is appended to
+  // confirmed_hashes, for checking that both sides agree
+  bool record_hashes = false;
+  std::vector<uint64_t> confirmed_hashes;
+
+  RollbackSession(NES& nes, Transport& transport, int local_player);
+  // Runs the next frame with the given local buttons. Returns false without
+  // running anything if it would need to roll back more than
+  // max_rollback_frames, in which case the caller should retry next frame.
+  bool advance_frame(uint8_t local_input);
+  int frame() const { return current_frame; }
+  // Last frame for which both inputs are known
+  int confirmed_frame() const;
+
+ private:
+  static constexpr int input_history = 256;
+  static constexpr int num_snapshots = max_rollback_frames + 2;
+
+  NES& nes;
+  Transport& transport;
+  int local_player;
+
+  int current_frame = 0;
+  int remote_confirmed = -1;    // last frame of remote input received
+  int remote_ack = -1;          // last frame of local input the remote has
+  int first_mispredicted = -1;  // earliest frame to re-simulate, if any
+  uint8_t local_inputs[input_history] = {0};
+  uint8_t remote_inputs[input_history] = {0};
+  uint8_t predicted_inputs[input_history] = {0};  // remote input simulated
+  std::vector<uint8_t> snapshots[num_snapshots];  // state before each frame
+
+  uint8_t predict(int frame);
+  void run_frame(int frame, bool output);
+  void receive();
+  void send();
+  void rollback();
+  void update_confirmed_hashes();
+};
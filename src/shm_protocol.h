@@ -0,0 +1,58 @@
+#pragma once
+// Protocol of the shared memory server (nes-headless --serve). A client
+// connects to the server's Unix socket and gets a NesShmHello naming a POSIX
+// shared memory region, which it maps. The region starts with a NesShmHeader,
+// followed by the RAM, frame and audio at the offsets it gives.
+//
+// Each NesShmRequest the client sends gets a NesShmReply once the server is
+// done, and only then is the region updated. Buttons are read from the header
+// by every step, so the client writes them first.
+#include <stdint.h>
+
+#define NES_SHM_MAGIC 0x314D4853  // "SHM1"
+
+enum {
+  // Runs arg frames (drawing only the last) with the header's buttons, up
+  // to NES_SHM_MAX_STEP. 0 frames just replies, to measure the round trip.
+  NES_SHM_STEP = 1,
+  NES_SHM_RESET = 2,  // back to power on
+  NES_SHM_SAVE = 3,   // to slot arg
+  NES_SHM_LOAD = 4,   // from slot arg, failing if it's empty
+  NES_SHM_QUIT = 5,   // stops the server after replying
+};
+
+#define NES_SHM_SLOTS 16
+#define NES_SHM_MAX_STEP 3600  // a minute
+
+typedef struct NesShmHello {
+  uint32_t magic;
+  uint32_t size;  // of the region
+  char name[56];  // for shm_open()
+} NesShmHello;
+
+typedef struct NesShmRequest {
+  uint32_t command;  // NES_SHM_*
+  uint32_t arg;
+} NesShmRequest;
+
+typedef struct NesShmReply {
+  int32_t status;  // 0 on success, -1 on failure
+  uint32_t frame;
+} NesShmReply;
+
+typedef struct NesShmHeader {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t ram_offset;      // the 2 KB of CPU RAM
+  uint32_t pixels_offset;   // 240x256 RGB
+  uint32_t audio_offset;    // interleaved stereo int16 samples
+  uint32_t audio_capacity;  // in int16 values
+  uint32_t audio_rate;
+  // Written by the server before each reply
+  uint32_t frame;       // frames since power on
+  uint32_t audio_size;  // int16 values from the last step
+  uint8_t lag_frame;    // the last step never read the joypads
+  // Written by the client: joypad 1 and 2 buttons, as in nes_env.h
+  uint8_t buttons[2];
+  uint8_t reserved;
+} NesShmHeader;
@@ -0,0 +1,370 @@
+#include "shm_server.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+namespace {
+
+constexpr size_t ram_size = 0x800;
+constexpr size_t pixels_size = 240 * 256 * 3;
+// Enough for several frames at up to 96 kHz
+constexpr size_t audio_capacity = 16384;
+
+size_t align(size_t offset) {
+  return (offset + 63) & ~(size_t)63;
+}
+
+#ifndef _WIN32
+bool read_all(int socket, void* data, size_t size) {
+  uint8_t* bytes = (uint8_t*)data;
+  while (size > 0) {
+    ssize_t n = recv(socket, bytes, size, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool write_all(int socket, const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (size > 0) {
+    ssize_t n = send(socket, bytes, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool make_address(const char* path, sockaddr_un& address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+  return true;
+}
+#endif
+
+}  // namespace
+
+ShmServer::ShmServer(NES& nes) : nes(nes) {}
+
+ShmServer::~ShmServer() {
+  close();
+}
+
+#ifdef _WIN32
+
+bool ShmServer::open(const char* socket_path) {
+  fprintf(stderr, "The shared memory server needs POSIX\n");
+  return false;
+}
+void ShmServer::close() {}
+void ShmServer::run() {}
+void ShmServer::stop() {}
+bool ShmServer::serve(int client) {
+  return false;
+}
+int ShmServer::handle(const NesShmRequest& request) {
+  return -1;
+}
+void ShmServer::step(int frames) {}
+void ShmServer::publish(bool video) {}
+
+ShmClient::~ShmClient() {}
+bool ShmClient::connect(const char* socket_path) {
+  fprintf(stderr, "The shared memory client needs POSIX\n");
+  return false;
+}
+void ShmClient::close() {}
+int ShmClient::request(uint32_t command, uint32_t arg) {
+  return -1;
+}
+
+#else
+
+bool ShmServer::open(const char* socket_path) {
+  close();
+  size_t pixels_offset = align(sizeof(NesShmHeader) + ram_size);
+  size_t audio_offset = align(pixels_offset + pixels_size);
+  region_size = align(audio_offset + audio_capacity * sizeof(int16_t));
+
+  char name[sizeof(NesShmHello::name)];
+  snprintf(name, sizeof(name), "/nes-emu-%d", (int)getpid());
+  shm_name = name;
+  shm_unlink(name);  // left over from a crashed server with the same pid
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Could not create shared memory %s\n", name);
+    return false;
+  }
+  bool mapped = ftruncate(fd, region_size) == 0;
+  if (mapped) {
+    void* memory = mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    mapped = memory != MAP_FAILED;
+    region = mapped ? (uint8_t*)memory : nullptr;
+  }
+  ::close(fd);
+  if (!mapped) {
+    fprintf(stderr, "Could not map shared memory %s\n", name);
+    close();
+    return false;
+  }
+
+  NesShmHeader* h = header();
+  memset(h, 0, sizeof(NesShmHeader));
+  h->magic = NES_SHM_MAGIC;
+  h->size = region_size;
+  h->ram_offset = sizeof(NesShmHeader);
+  h->pixels_offset = pixels_offset;
+  h->audio_offset = audio_offset;
+  h->audio_capacity = audio_capacity;
+  h->audio_rate = 44100;
+  nes.apu.set_output_rate(h->audio_rate);
+
+  sockaddr_un address;
+  if (!make_address(socket_path, address)) {
+    close();
+    return false;
+  }
+  listen_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if (listen_socket < 0 ||
+      bind(listen_socket, (sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(listen_socket, 1) != 0) {
+    fprintf(stderr, "Could not listen on %s\n", socket_path);
+    close();
+    return false;
+  }
+  this->socket_path = socket_path;
+
+  nes.save_state(power_on_state);
+  frame = 0;
+  publish(false);
+  return true;
+}
+
+void ShmServer::close() {
+  if (listen_socket >= 0) {
+    ::close(listen_socket);
+    listen_socket = -1;
+    unlink(socket_path.c_str());
+  }
+  if (region) {
+    munmap(region, region_size);
+    region = nullptr;
+    shm_unlink(shm_name.c_str());
+  }
+}
+
+void ShmServer::run() {
+  while (!stopping) {
+    int client = accept(listen_socket, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    NesShmHello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = NES_SHM_MAGIC;
+    hello.size = region_size;
+    snprintf(hello.name, sizeof(hello.name), "%s", shm_name.c_str());
+    bool quit = false;
+    if (write_all(client, &hello, sizeof(hello))) {
+      quit = !serve(client);
+    }
+    ::close(client);
+    if (quit) {
+      break;
+    }
+  }
+}
+
+void ShmServer::stop() {
+  stopping = true;
+  // Wakes up accept()
+  if (listen_socket >= 0) {
+    shutdown(listen_socket, SHUT_RDWR);
+  }
+}
+
+bool ShmServer::serve(int client) {
+  NesShmRequest request;
+  while (!stopping && read_all(client, &request, sizeof(request))) {
+    NesShmReply reply;
+    reply.status = handle(request);
+    reply.frame = frame;
+    if (!write_all(client, &reply, sizeof(reply))) {
+      return true;
+    }
+    if (request.command == NES_SHM_QUIT) {
+      return false;
+    }
+  }
+  return !stopping;
+}
+
+int ShmServer::handle(const NesShmRequest& request) {
+  switch (request.command) {
+    case NES_SHM_STEP:
+      if (request.arg > NES_SHM_MAX_STEP) {
+        return -1;
+      }
+      step(request.arg);
+      return 0;
+    case NES_SHM_RESET:
+      nes.load_state(power_on_state);
+      frame = 0;
+      publish(false);
+      return 0;
+    case NES_SHM_SAVE:
+      if (request.arg >= NES_SHM_SLOTS) {
+        return -1;
+      }
+      nes.save_state(slots[request.arg].state);
+      slots[request.arg].frame = frame;
+      return 0;
+    case NES_SHM_LOAD:
+      if (request.arg >= NES_SHM_SLOTS ||
+          !nes.load_state(slots[request.arg].state)) {
+        return -1;
+      }
+      frame = slots[request.arg].frame;
+      publish(false);
+      return 0;
+    case NES_SHM_QUIT:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+void ShmServer::step(int frames) {
+  NesShmHeader* h = header();
+  nes.joypad.set_buttons(0, h->buttons[0]);
+  nes.joypad.set_buttons(1, h->buttons[1]);
+  int16_t* audio = (int16_t*)(region + h->audio_offset);
+  size_t audio_size = 0;
+  bool lag = true;
+  for (int f = 0; f < frames; f++) {
+    nes.ppu.output_enabled = f == frames - 1;
+    nes.run_frame();
+    frame++;
+    lag = lag && nes.lag_frame();
+    const std::vector<int16_t>& samples = nes.apu.output_buffer;
+    size_t count = std::min(samples.size(), audio_capacity - audio_size);
+    memcpy(audio + audio_size, samples.data(), count * sizeof(int16_t));
+    audio_size += count;
+  }
+  nes.ppu.output_enabled = true;
+  if (frames > 0) {
+    h->audio_size = audio_size;
+    h->lag_frame = lag;
+  }
+  publish(frames > 0);
+}
+
+void ShmServer::publish(bool video) {
+  NesShmHeader* h = header();
+  memcpy(region + h->ram_offset, nes.cpu.RAM, ram_size);
+  if (video) {
+    memcpy(region + h->pixels_offset, nes.ppu.pixels, pixels_size);
+  }
+  h->frame = frame;
+}
+
+ShmClient::~ShmClient() {
+  close();
+}
+
+bool ShmClient::connect(const char* socket_path) {
+  close();
+  sockaddr_un address;
+  if (!make_address(socket_path, address)) {
+    return false;
+  }
+  socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket < 0 ||
+      ::connect(socket, (sockaddr*)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Could not connect to %s\n", socket_path);
+    close();
+    return false;
+  }
+  NesShmHello hello;
+  if (!read_all(socket, &hello, sizeof(hello)) ||
+      hello.magic != NES_SHM_MAGIC) {
+    fprintf(stderr, "No shared memory server at %s\n", socket_path);
+    close();
+    return false;
+  }
+  hello.name[sizeof(hello.name) - 1] = '\0';
+  int fd = shm_open(hello.name, O_RDWR, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open shared memory %s\n", hello.name);
+    close();
+    return false;
+  }
+  void* memory =
+      mmap(nullptr, hello.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "Could not map shared memory %s\n", hello.name);
+    close();
+    return false;
+  }
+  region = (uint8_t*)memory;
+  region_size = hello.size;
+  return true;
+}
+
+void ShmClient::close() {
+  if (socket >= 0) {
+    ::close(socket);
+    socket = -1;
+  }
+  if (region) {
+    munmap(region, region_size);
+    region = nullptr;
+  }
+}
+
+int ShmClient::request(uint32_t command, uint32_t arg) {
+  NesShmRequest request = {command, arg};
+  NesShmReply reply;
+  if (!write_all(socket, &request, sizeof(request)) ||
+      !read_all(socket, &reply, sizeof(reply))) {
+    return -1;
+  }
+  return reply.status;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "nes/nes.h"
+#include "shm_protocol.h"
+
+// Serves one NES to out of process clients (see shm_protocol.h), one client
+// at a time. POSIX only; open() fails elsewhere.
+class ShmServer {
+ public:
+  explicit ShmServer(NES& nes);
+  ~ShmServer();
+  // Creates the shared memory region and listens on a Unix socket at path
+  bool open(const char* socket_path);
+  void close();
+  // Serves clients until one sends NES_SHM_QUIT or stop() is called
+  void run();
+  // Makes run() return, from any thread. A connected client is only dropped
+  // at its next request.
+  void stop();
+
+ private:
+  struct Slot {
+    std::vector<uint8_t> state;
+    uint32_t frame = 0;
+  };
+
+  NES& nes;
+  int listen_socket = -1;
+  std::string socket_path;
+  std::string shm_name;
+  uint8_t* region = nullptr;
+  size_t region_size = 0;
+  std::vector<uint8_t> power_on_state;
+  Slot slots[NES_SHM_SLOTS];
+  uint32_t frame = 0;
+  std::atomic<bool> stopping{false};
+
+  NesShmHeader* header() { return (NesShmHeader*)region; }
+  // Returns false once the client should be disconnected
+  bool serve(int client);
+  int handle(const NesShmRequest& request);
+  void step(int frames);
+  // Copies the RAM, and the frame if it was drawn, to the region
+  void publish(bool video);
+};
+
+// The other end of a ShmServer, used by nes-headless --connect
+class ShmClient {
+ public:
+  ~ShmClient();
+  bool connect(const char* socket_path);
+  void close();
+  // Sends a request and waits for the reply, returning its status
+  int request(uint32_t command, uint32_t arg = 0);
+
+  NesShmHeader* header() { return (NesShmHeader*)region; }
+  const uint8_t* ram() { return region + header()->ram_offset; }
+  const uint8_t* pixels() { return region + header()->pixels_offset; }
+  const int16_t* audio() {
+    return (const int16_t*)(region + header()->audio_offset);
+  }
+
+ private:
+  int socket = -1;
+  uint8_t* region = nullptr;
+  size_t region_size = 0;
+};
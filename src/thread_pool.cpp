@@ -0,0 +1,73 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads) {
+  if (threads <= 0) {
+    threads = std::max((int)std::thread::hardware_concurrency(), 1);
+  }
+  for (int i = 1; i < threads; i++) {
+    workers.emplace_back(&ThreadPool::loop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_condition.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)>& fn) {
+  if (workers.empty() || count <= 1) {
+    for (int i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    job_count = count;
+    next_index = 0;
+    busy_workers = workers.size();
+    generation++;
+  }
+  start_condition.notify_all();
+  run_jobs();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done_condition.wait(lock, [this] { return busy_workers == 0; });
+  job = nullptr;
+}
+
+void ThreadPool::loop() {
+  uint64_t seen_generation = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    start_condition.wait(lock, [&] {
+      return stopping || generation != seen_generation;
+    });
+    if (stopping) {
+      return;
+    }
+    seen_generation = generation;
+    lock.unlock();
+    run_jobs();
+    lock.lock();
+    if (--busy_workers == 0) {
+      done_condition.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run_jobs() {
+  // Jobs are handed out one at a time, since their costs vary
+  int i;
+  while ((i = next_index.fetch_add(1)) < job_count) {
+    (*job)(i);
+  }
+}
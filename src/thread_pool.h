@@ -0,0 +1,35 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for running a batch of independent jobs, such
+// as stepping many emulators. The calling thread works on the batch too.
+class ThreadPool {
+ public:
+  // threads counts the calling thread; 0 uses one per hardware thread
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
+  int size() const { return (int)workers.size() + 1; }
+  // Calls fn(i) for each i in [0, count) and waits for all of them
+  void parallel_for(int count, const std::function<void(int)>& fn);
+
+ private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable start_condition;
+  std::condition_variable done_condition;
+  bool stopping = false;
+  uint64_t generation = 0;  // bumped for each batch
+  int busy_workers = 0;
+
+  const std::function<void(int)>* job = nullptr;
+  int job_count = 0;
+  std::atomic<int> next_index{0};
+
+  void loop();
+  void run_jobs();
+};
@@ -0,0 +1,162 @@
+#include "transport.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+using SocketHandle = SOCKET;
+#else
+using SocketHandle = int;
+#endif
+
+UdpTransport::~UdpTransport() {
+  close();
+}
+
+bool UdpTransport::open(int local_port,
+                        const char* remote_host,
+                        int remote_port) {
+  close();
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+    fprintf(stderr, "WSAStartup failed\n");
+    return false;
+  }
+  wsa_started = true;
+#endif
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* remote = nullptr;
+  char port[16];
+  snprintf(port, sizeof(port), "%d", remote_port);
+  if (getaddrinfo(remote_host, port, &hints, &remote) != 0 || !remote) {
+    fprintf(stderr, "Could not resolve %s\n", remote_host);
+    close();
+    return false;
+  }
+  memcpy(&remote_address, remote->ai_addr, remote->ai_addrlen);
+  remote_address_size = (int)remote->ai_addrlen;
+  freeaddrinfo(remote);
+
+  SocketHandle s = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+#ifdef _WIN32
+  if (s == INVALID_SOCKET) {
+#else
+  if (s < 0) {
+#endif
+    fprintf(stderr, "Could not create socket\n");
+    close();
+    return false;
+  }
+  socket = (intptr_t)s;
+
+  sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(local_port);
+  if (bind(s, (sockaddr*)&local, sizeof(local)) != 0) {
+    fprintf(stderr, "Could not bind to port %d\n", local_port);
+    close();
+    return false;
+  }
+
+#ifdef _WIN32
+  u_long non_blocking = 1;
+  ioctlsocket(s, FIONBIO, &non_blocking);
+#else
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+  return true;
+}
+
+void UdpTransport::close() {
+  if (socket != -1) {
+#ifdef _WIN32
+    closesocket((SocketHandle)socket);
+#else
+    ::close((SocketHandle)socket);
+#endif
+    socket = -1;
+  }
+#ifdef _WIN32
+  if (wsa_started) {
+    WSACleanup();
+    wsa_started = false;
+  }
+#endif
+}
+
+void UdpTransport::send(const void* data, size_t size) {
+  if (socket == -1) {
+    return;
+  }
+  sendto((SocketHandle)socket, (const char*)data, (int)size, 0,
+         (const sockaddr*)&remote_address, remote_address_size);
+}
+
+int UdpTransport::receive(void* data, size_t max_size) {
+  if (socket == -1) {
+    return -1;
+  }
+  while (true) {
+    sockaddr_storage from;
+    socklen_t from_size = sizeof(from);
+    int size = recvfrom((SocketHandle)socket, (char*)data, (int)max_size, 0,
+                        (sockaddr*)&from, &from_size);
+    if (size < 0) {
+      return -1;
+    }
+    // Ignore anything that isn't from the peer
+    const sockaddr_in& a = (const sockaddr_in&)from;
+    const sockaddr_in& b = (const sockaddr_in&)remote_address;
+    if (a.sin_port == b.sin_port && a.sin_addr.s_addr == b.sin_addr.s_addr) {
+      return size;
+    }
+  }
+}
+
+LoopbackLink::LoopbackLink(int latency, float loss, uint32_t seed)
+    : latency(latency), loss(loss), rng(seed) {}
+
+void LoopbackLink::tick() {
+  std::lock_guard<std::mutex> lock(mutex);
+  time++;
+}
+
+void LoopbackTransport::send(const void* data, size_t size) {
+  std::lock_guard<std::mutex> lock(link.mutex);
+  if (link.loss > 0 &&
+      std::uniform_real_distribution<float>(0, 1)(link.rng) < link.loss) {
+    return;
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  link.queues[1 - side].push_back(
+      {link.time + link.latency, std::vector<uint8_t>(bytes, bytes + size)});
+}
+
+int LoopbackTransport::receive(void* data, size_t max_size) {
+  std::lock_guard<std::mutex> lock(link.mutex);
+  std::deque<LoopbackLink::Packet>& queue = link.queues[side];
+  if (queue.empty() || queue.front().deliver_time > link.time) {
+    return -1;
+  }
+  LoopbackLink::Packet& packet = queue.front();
+  size_t size = std::min(packet.data.size(), max_size);
+  memcpy(data, packet.data.data(), size);
+  queue.pop_front();
+  return (int)size;
+}
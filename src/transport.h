@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <vector>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+// Unreliable, unordered datagram channel to a single peer, as used by
+// netplay. Implementations must not block.
+class Transport {
+ public:
+  virtual ~Transport() = default;
+  virtual void send(const void* data, size_t size) = 0;
+  // Copies the next received packet into data and returns its size, or
+  // returns -1 if nothing is waiting
+  virtual int receive(void* data, size_t max_size) = 0;
+};
+
+// UDP socket connected to one remote address
+class UdpTransport : public Transport {
+ public:
+  ~UdpTransport();
+  bool open(int local_port, const char* remote_host, int remote_port);
+  void close();
+  void send(const void* data, size_t size) override;
+  int receive(void* data, size_t max_size) override;
+
+ private:
+  intptr_t socket = -1;
+  sockaddr_storage remote_address;
+  int remote_address_size = 0;
+  bool wsa_started = false;
+};
+
+// In-process link between two LoopbackTransports, which simulates latency
+// (in ticks, usually frames) and packet loss for testing
+class LoopbackLink {
+ public:
+  LoopbackLink(int latency = 0, float loss = 0.0f, uint32_t seed = 1);
+  // Advances the simulated time by one tick
+  void tick();
+
+ private:
+  friend class LoopbackTransport;
+  struct Packet {
+    int deliver_time;
+    std::vector<uint8_t> data;
+  };
+
+  std::mutex mutex;
+  std::deque<Packet> queues[2];  // by receiving side
+  int time = 0;
+  int latency;
+  float loss;
+  std::mt19937 rng;
+};
+
+class LoopbackTransport : public Transport {
+ public:
+  LoopbackTransport(LoopbackLink& link, int side) : link(link), side(side) {}
+  void send(const void* data, size_t size) override;
+  int receive(void* data, size_t max_size) override;
+
+ private:
+  LoopbackLink& link;
+  int side;
+};
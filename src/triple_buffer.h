@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer for handing the latest value from one producer
+// thread to one consumer thread. The producer fills back() and calls
+// publish(); the consumer calls read() to get the most recently published
+// value. Neither side ever waits, and stale values are simply dropped.
+template <typename T>
+class TripleBuffer {
+ public:
+  T& back() { return buffers[back_index]; }
+
+  void publish() {
+    // Swap the back buffer with the middle one, and flag it as new
+    uint8_t old_middle =
+        middle.exchange(back_index | new_flag, std::memory_order_acq_rel);
+    back_index = old_middle & index_mask;
+  }
+
+  // Returns the latest published value (or the previous one if nothing new
+  // has been published since the last call)
+  const T& read() {
+    if (middle.load(std::memory_order_relaxed) & new_flag) {
+      uint8_t old_middle =
+          middle.exchange(front_index, std::memory_order_acq_rel);
+      front_index = old_middle & index_mask;
+    }
+    return buffers[front_index];
+  }
+
+ private:
+  static constexpr uint8_t new_flag = 0x4;
+  static constexpr uint8_t index_mask = 0x3;
+
+  T buffers[3] = {};
+  uint8_t back_index = 0;
+  uint8_t front_index = 1;
+  std::atomic<uint8_t> middle{2};
+};
@@ -0,0 +1,213 @@
+#include "vec_env.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr size_t pixels_size = 240 * 256 * 3;
+constexpr size_t ram_size = 0x800;
+
+// splitmix64, to turn seeds into no-op counts and the next episode's seed
+uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+VecEnv::VecEnv(const NesEnvConfig& config)
+    : config(config), pool(config.num_threads) {
+  this->config.num_envs = std::max(config.num_envs, 1);
+  this->config.frameskip = std::max(config.frameskip, 1);
+  this->config.noop_max = std::max(config.noop_max, 0);
+  this->config.reward_bytes = std::min(std::max(config.reward_bytes, 1), 4);
+  this->config.frame_stack = std::max(config.frame_stack, 1);
+  ObservationFormat format;
+  format.width = config.obs_width;
+  format.height = config.obs_height;
+  format.crop_top = config.crop_top;
+  format.crop_bottom = config.crop_bottom;
+  format.crop_left = config.crop_left;
+  format.crop_right = config.crop_right;
+  processor.configure(format);
+  if (config.cache_mb > 0) {
+    cache = std::make_unique<TransitionCache>((size_t)config.cache_mb << 20);
+  }
+}
+
+bool VecEnv::load(const char* rom) {
+  auto first = std::make_unique<NES>();
+  first->load(rom);
+  if (!first->loaded) {
+    return false;
+  }
+  envs.resize(config.num_envs);
+  envs[0].nes = std::move(first);
+  // The rest are forks of the first, sharing its ROM
+  std::vector<uint8_t> scratch;
+  for (Env& env : envs) {
+    if (!env.nes) {
+      env.nes = std::make_unique<NES>();
+      envs[0].nes->fork(*env.nes, scratch);
+    }
+    // Nothing listens to the audio
+    env.nes->apu.output_enabled = false;
+    if (config.observation == NES_ENV_OBS_GREYSCALE) {
+      // Luma comes straight from the palette indices
+      env.nes->ppu.resolve_enabled = false;
+      env.pool_luma.resize(processor.luma_size());
+      env.stack.resize(observation_size());
+    }
+  }
+  processor.set_palette(envs[0].nes->palette);
+  envs[0].nes->save_state(power_on_state);
+  return true;
+}
+
+size_t VecEnv::observation_size() const {
+  switch (config.observation) {
+    case NES_ENV_OBS_RAM:
+      return ram_size;
+    case NES_ENV_OBS_GREYSCALE:
+      return processor.output_size() * config.frame_stack;
+    default:
+      return pixels_size;
+  }
+}
+
+void VecEnv::reset(const uint64_t* seeds, uint8_t* observations) {
+  size_t size = observation_size();
+  pool.parallel_for(num_envs(), [&](int i) {
+    reset_env(envs[i], seeds ? seeds[i] : i, observations + i * size);
+  });
+}
+
+void VecEnv::step(const uint8_t* actions,
+                  uint8_t* observations,
+                  float* rewards,
+                  uint8_t* dones) {
+  size_t size = observation_size();
+  bool video = config.observation != NES_ENV_OBS_RAM;
+  int frames = config.frameskip;
+  bool max_pool = video && config.max_pool && frames >= 2;
+  pool.parallel_for(num_envs(), [&](int i) {
+    Env& env = envs[i];
+    NES& nes = *env.nes;
+    uint8_t* observation = observations + i * size;
+    nes.joypad.set_buttons(0, actions[i]);
+    // Only the observed frames are drawn
+    for (int f = 0; f < frames; f++) {
+      bool last = f == frames - 1;
+      bool pooled = max_pool && f == frames - 2;
+      run_frame(env, video && (last || pooled));
+      if (pooled) {
+        save_pool(env, observation);
+      }
+    }
+    observe(env, observation, max_pool, false);
+
+    uint32_t value = reward_value(env);
+    if (rewards) {
+      rewards[i] = (float)((int64_t)value - env.reward_value);
+    }
+    env.reward_value = value;
+    env.steps++;
+    bool done =
+        (config.max_episode_steps > 0 &&
+         env.steps >= config.max_episode_steps) ||
+        (config.done_address >= 0 &&
+         nes.cpu.peek(config.done_address) == config.done_value);
+    if (dones) {
+      dones[i] = done;
+    }
+    if (done) {
+      reset_env(env, mix(env.seed), observation);
+    }
+  });
+}
+
+void VecEnv::reset_env(Env& env, uint64_t seed, uint8_t* observation) {
+  NES& nes = *env.nes;
+  env.seed = seed;
+  env.steps = 0;
+  nes.load_state(power_on_state);
+  nes.joypad.set_buttons(0, 0);
+  int noops = mix(seed) % (config.noop_max + 1);
+  for (int i = 0; i < noops; i++) {
+    run_frame(env, false);
+  }
+  run_frame(env, config.observation != NES_ENV_OBS_RAM);
+  observe(env, observation, false, true);
+  env.reward_value = reward_value(env);
+}
+
+TransitionCache::Stats VecEnv::cache_stats() const {
+  return cache ? cache->stats() : TransitionCache::Stats();
+}
+
+void VecEnv::run_frame(Env& env, bool video) {
+  env.nes->ppu.output_enabled = video;
+  if (cache && !video) {
+    cache->run_frame(*env.nes);
+  } else {
+    env.nes->run_frame();
+  }
+}
+
+void VecEnv::save_pool(Env& env, uint8_t* observation) {
+  PPU& ppu = env.nes->ppu;
+  if (config.observation == NES_ENV_OBS_GREYSCALE) {
+    processor.luma(ppu.indices, env.pool_luma.data());
+  } else {
+    // The observation is overwritten by the max anyway
+    memcpy(observation, ppu.pixels, pixels_size);
+  }
+}
+
+void VecEnv::observe(Env& env,
+                     uint8_t* observation,
+                     bool max_pool,
+                     bool reset) {
+  NES& nes = *env.nes;
+  if (config.observation == NES_ENV_OBS_RAM) {
+    memcpy(observation, nes.cpu.RAM, ram_size);
+  } else if (config.observation == NES_ENV_OBS_GREYSCALE) {
+    // The stack is kept per env, so callers can pass a different buffer
+    // each step
+    uint8_t* stack = env.stack.data();
+    size_t plane = processor.output_size();
+    size_t older = plane * (config.frame_stack - 1);
+    uint8_t* newest = stack + older;
+    if (!reset) {
+      memmove(stack, stack + plane, older);
+    }
+    processor.process(nes.ppu.indices,
+                      max_pool ? env.pool_luma.data() : nullptr, newest);
+    if (reset) {
+      for (size_t i = 0; i < older; i += plane) {
+        memcpy(stack + i, newest, plane);
+      }
+    }
+    memcpy(observation, stack, env.stack.size());
+  } else if (max_pool) {
+    const uint8_t* pixels = &nes.ppu.pixels[0][0][0];
+    for (size_t i = 0; i < pixels_size; i++) {
+      observation[i] = std::max(observation[i], pixels[i]);
+    }
+  } else {
+    memcpy(observation, nes.ppu.pixels, pixels_size);
+  }
+}
+
+uint32_t VecEnv::reward_value(Env& env) {
+  if (config.reward_address < 0) {
+    return 0;
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < config.reward_bytes; i++) {
+    value |= env.nes->cpu.peek(config.reward_address + i) << (i * 8);
+  }
+  return value;
+}
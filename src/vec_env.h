@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "nes/nes.h"
+#include "nes/transition_cache.h"
+#include "nes_env.h"
+#include "observation.h"
+#include "thread_pool.h"
+
+// The environments behind the nes_env C API. Each one is a separate NES, and
+// a step runs them all across a thread pool, each writing its observation
+// straight into the caller's buffer.
+class VecEnv {
+ public:
+  explicit VecEnv(const NesEnvConfig& config);
+  bool load(const char* rom);
+  int num_envs() const { return envs.size(); }
+  int num_threads() const { return pool.size(); }
+  size_t observation_size() const;
+  void reset(const uint64_t* seeds, uint8_t* observations);
+  void step(const uint8_t* actions,
+            uint8_t* observations,
+            float* rewards,
+            uint8_t* dones);
+  TransitionCache::Stats cache_stats() const;
+
+ private:
+  struct Env {
+    std::unique_ptr<NES> nes;
+    uint64_t seed = 0;
+    int steps = 0;
+    uint32_t reward_value = 0;  // at reward_address after the last step
+    std::vector<uint8_t> pool_luma;  // of the frame before the last one
+    std::vector<uint8_t> stack;      // greyscale planes, oldest first
+  };
+
+  NesEnvConfig config;
+  ThreadPool pool;
+  std::vector<Env> envs;
+  std::vector<uint8_t> power_on_state;
+  ObservationProcessor processor;
+  std::unique_ptr<TransitionCache> cache;  // if cache_mb is set
+
+  void reset_env(Env& env, uint64_t seed, uint8_t* observation);
+  // Runs a frame, only drawing it if video is set. Other frames may come from
+  // the cache.
+  void run_frame(Env& env, bool video);
+  // Keeps the frame to max pool the next observation with
+  void save_pool(Env& env, uint8_t* observation);
+  // Writes the observation, max pooled with the saved frame if max_pool is
+  // set. Greyscale pushes the new plane onto the stack, or with reset, fills
+  // the whole stack with it.
+  void observe(Env& env, uint8_t* observation, bool max_pool, bool reset);
+  uint32_t reward_value(Env& env);
+};
@@ -0,0 +1,250 @@
+#include "video_filter.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr int width = 256;
+constexpr int height = 240;
+
+uint8_t clamp(int value) {
+  return (uint8_t)std::min(std::max(value, 0), 255);
+}
+
+void nearest(const uint8_t (&in)[240][256][3], int scale, uint8_t* out) {
+  int row_size = width * scale * 3;
+  for (int y = 0; y < height; y++) {
+    uint8_t* row = out + y * scale * row_size;
+    uint8_t* p = row;
+    for (int x = 0; x < width; x++) {
+      for (int i = 0; i < scale; i++) {
+        p[0] = in[y][x][0];
+        p[1] = in[y][x][1];
+        p[2] = in[y][x][2];
+        p += 3;
+      }
+    }
+    for (int i = 1; i < scale; i++) {
+      memcpy(row + i * row_size, row, row_size);
+    }
+  }
+}
+
+// Packs a row into 32 bit pixels, with the edge pixels repeated on each side,
+// so neighbours compare in one instruction
+void pack_row(const uint8_t (&in)[240][256][3], int y, uint32_t* out) {
+  y = std::min(std::max(y, 0), height - 1);
+  for (int x = 0; x < width; x++) {
+    out[x + 1] = in[y][x][0] | (in[y][x][1] << 8) | (in[y][x][2] << 16);
+  }
+  out[0] = out[1];
+  out[width + 1] = out[width];
+}
+
+// For each output 2x2 block around pixel P with neighbours A (up), B (right),
+// C (left) and D (down):
+//   1 = C == A && C != D && A != B ? A : P
+//   2 = A == B && A != C && B != D ? B : P
+//   3 = D == C && D != B && C != A ? C : P
+//   4 = B == D && B != A && D != C ? D : P
+void scale2x(const uint8_t (&in)[240][256][3], uint8_t* out) {
+  uint32_t rows[3][width + 2];
+  pack_row(in, -1, rows[0]);
+  pack_row(in, 0, rows[1]);
+  int row_size = width * 2 * 3;
+  for (int y = 0; y < height; y++) {
+    uint8_t* top = out + (y * 2) * row_size;
+    uint8_t* bottom = top + row_size;
+    uint32_t* above = rows[y % 3];
+    uint32_t* center = rows[(y + 1) % 3];
+    uint32_t* below = rows[(y + 2) % 3];
+    pack_row(in, y + 1, below);
+    for (int x = 0; x < width; x++) {
+      uint32_t p = center[x + 1];
+      uint32_t a = above[x + 1];
+      uint32_t b = center[x + 2];
+      uint32_t c = center[x];
+      uint32_t d = below[x + 1];
+      uint32_t e[4] = {
+          c == a && c != d && a != b ? a : p,
+          a == b && a != c && b != d ? b : p,
+          d == c && d != b && c != a ? c : p,
+          b == d && b != a && d != c ? d : p,
+      };
+      uint8_t* targets[4] = {top + x * 6, top + x * 6 + 3, bottom + x * 6,
+                             bottom + x * 6 + 3};
+      for (int i = 0; i < 4; i++) {
+        targets[i][0] = e[i] & 0xFF;
+        targets[i][1] = (e[i] >> 8) & 0xFF;
+        targets[i][2] = (e[i] >> 16) & 0xFF;
+      }
+    }
+  }
+}
+
+// Approximates the look of a composite signal: the image is converted to YIQ
+// (8.8 fixed point), chroma gets the much lower bandwidth of the color
+// subcarrier, luma is softened slightly, and every other output line is
+// darkened for scanlines. It doesn't model dot crawl or artifact colors.
+void ntsc(const uint8_t (&in)[240][256][3], uint8_t* out) {
+  constexpr int pad = 3;
+  int16_t Y[width + pad * 2], I[width + pad * 2], Q[width + pad * 2];
+  uint8_t rgb[width * 2][3];
+  int row_size = width * 2 * 3;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int r = in[y][x][0], g = in[y][x][1], b = in[y][x][2];
+      Y[x + pad] = (77 * r + 150 * g + 29 * b) >> 8;
+      I[x + pad] = (153 * r - 70 * g - 82 * b) >> 8;
+      Q[x + pad] = (54 * r - 134 * g + 80 * b) >> 8;
+    }
+    for (int i = 0; i < pad; i++) {
+      Y[i] = Y[pad];
+      I[i] = I[pad];
+      Q[i] = Q[pad];
+      Y[width + pad + i] = Y[width + pad - 1];
+      I[width + pad + i] = I[width + pad - 1];
+      Q[width + pad + i] = Q[width + pad - 1];
+    }
+
+    for (int x = 0; x < width; x++) {
+      const int16_t* y0 = &Y[x + pad];
+      const int16_t* i0 = &I[x + pad];
+      const int16_t* q0 = &Q[x + pad];
+      // Luma [1 2 1] / 4, chroma [1 2 3 4 3 2 1] / 16
+      int luma = (y0[-1] + 2 * y0[0] + y0[1]) >> 2;
+      int i_blur = (i0[-3] + 2 * i0[-2] + 3 * i0[-1] + 4 * i0[0] +
+                    3 * i0[1] + 2 * i0[2] + i0[3]) >> 4;
+      int q_blur = (q0[-3] + 2 * q0[-2] + 3 * q0[-1] + 4 * q0[0] +
+                    3 * q0[1] + 2 * q0[2] + q0[3]) >> 4;
+      // Halfway to the next pixel for the odd output column
+      int luma_next = (y0[0] + 2 * y0[1] + y0[2]) >> 2;
+      int luma_half = (luma + luma_next) >> 1;
+
+      int r = (245 * i_blur + 159 * q_blur) >> 8;
+      int g = (-70 * i_blur - 166 * q_blur) >> 8;
+      int b = (-283 * i_blur + 436 * q_blur) >> 8;
+      rgb[x * 2][0] = clamp(luma + r);
+      rgb[x * 2][1] = clamp(luma + g);
+      rgb[x * 2][2] = clamp(luma + b);
+      rgb[x * 2 + 1][0] = clamp(luma_half + r);
+      rgb[x * 2 + 1][1] = clamp(luma_half + g);
+      rgb[x * 2 + 1][2] = clamp(luma_half + b);
+    }
+
+    uint8_t* top = out + (y * 2) * row_size;
+    uint8_t* bottom = top + row_size;
+    memcpy(top, rgb, row_size);
+    for (int i = 0; i < row_size; i++) {
+      bottom[i] = (top[i] * 3) >> 2;
+    }
+  }
+}
+
+}  // namespace
+
+const char* video_filter_name(VideoFilterType type) {
+  const char* names[(int)VideoFilterType::Count] = {
+      "none", "nearest2x", "nearest3x", "nearest4x", "scale2x", "ntsc",
+  };
+  return names[(int)type];
+}
+
+int video_filter_scale(VideoFilterType type) {
+  switch (type) {
+    case VideoFilterType::Nearest2x:
+    case VideoFilterType::Scale2x:
+    case VideoFilterType::Ntsc:
+      return 2;
+    case VideoFilterType::Nearest3x:
+      return 3;
+    case VideoFilterType::Nearest4x:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+void apply_video_filter(VideoFilterType type,
+                        const uint8_t (&in)[240][256][3],
+                        FilteredFrame& out) {
+  int scale = video_filter_scale(type);
+  out.width = width * scale;
+  out.height = height * scale;
+  out.pixels.resize(out.width * out.height * 3);
+  switch (type) {
+    case VideoFilterType::Nearest2x:
+    case VideoFilterType::Nearest3x:
+    case VideoFilterType::Nearest4x:
+      nearest(in, scale, out.pixels.data());
+      break;
+    case VideoFilterType::Scale2x:
+      scale2x(in, out.pixels.data());
+      break;
+    case VideoFilterType::Ntsc:
+      ntsc(in, out.pixels.data());
+      break;
+    default:
+      memcpy(out.pixels.data(), in, sizeof(in));
+      break;
+  }
+}
+
+VideoFilterThread::VideoFilterThread() {
+#ifndef __EMSCRIPTEN__
+  thread = std::thread(&VideoFilterThread::loop, this);
+#endif
+}
+
+VideoFilterThread::~VideoFilterThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  condition.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void VideoFilterThread::submit(VideoFilterType type,
+                               const uint8_t (&pixels)[240][256][3]) {
+#ifdef __EMSCRIPTEN__
+  // No threads, so filter immediately
+  apply_video_filter(type, pixels, output);
+  return;
+#endif
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return !pending; });
+  this->type = type;
+  memcpy(input, pixels, sizeof(input));
+  pending = true;
+  condition.notify_all();
+}
+
+const FilteredFrame& VideoFilterThread::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return !pending; });
+  return output;
+}
+
+bool VideoFilterThread::busy() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return pending;
+}
+
+void VideoFilterThread::loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    condition.wait(lock, [this] { return pending || quit; });
+    if (quit) {
+      return;
+    }
+    // input and output are only touched here while pending is set
+    lock.unlock();
+    apply_video_filter(type, input, output);
+    lock.lock();
+    pending = false;
+    condition.notify_all();
+  }
+}
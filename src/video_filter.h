@@ -0,0 +1,57 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// CPU post-processing of the 256x240 PPU output
+enum class VideoFilterType : int {
+  None = 0,
+  Nearest2x,
+  Nearest3x,
+  Nearest4x,
+  Scale2x,  // aka EPX
+  Ntsc,     // composite-like chroma blur, 2x with scanlines
+  Count
+};
+
+const char* video_filter_name(VideoFilterType type);
+// Output size is the input size times this
+int video_filter_scale(VideoFilterType type);
+
+struct FilteredFrame {
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> pixels;  // RGB, row major
+};
+
+void apply_video_filter(VideoFilterType type,
+                        const uint8_t (&in)[240][256][3],
+                        FilteredFrame& out);
+
+// Runs video filters on a worker thread. One frame is in flight at a time:
+// submit() copies the input and returns immediately (after waiting for the
+// previous frame), and wait() returns the result. Without threads
+// (emscripten), submit() does the work itself.
+class VideoFilterThread {
+ public:
+  VideoFilterThread();
+  ~VideoFilterThread();
+  void submit(VideoFilterType type, const uint8_t (&pixels)[240][256][3]);
+  const FilteredFrame& wait();
+  bool busy();
+
+ private:
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool pending = false;
+  bool quit = false;
+
+  VideoFilterType type = VideoFilterType::None;
+  uint8_t input[240][256][3];
+  FilteredFrame output;
+
+  void loop();
+};